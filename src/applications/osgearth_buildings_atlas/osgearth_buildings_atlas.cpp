@@ -0,0 +1,327 @@
+/* -*-c++-*- */
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/**
+ * Packs the skins in a building resource catalog into 2D texture arrays
+ * and writes out a rewritten catalog that references them.
+ *
+ * Every skin becomes one layer of the array, resized to a common size,
+ * with a full mipmap chain. Since each layer holds an entire image, tiled
+ * skins still wrap correctly: the rewritten skins use a bias of 0, a scale
+ * of 1, and their layer index. Relative urls of everything else (models,
+ * and skins that failed to load) are rebased onto the output folder.
+ *
+ * Usage:
+ *   osgearth_buildings_atlas --in catalog.xml --out atlas/catalog.xml
+ *                            [--size 512] [--max-layers 256]
+ */
+
+#include <osgEarth/Notify>
+#include <osgEarth/URI>
+#include <osgEarth/XmlUtils>
+#include <osgEarth/ImageUtils>
+#include <osgEarth/FileUtils>
+#include <osgEarth/StringUtils>
+#include <osg/ArgumentParser>
+#include <osg/Texture2DArray>
+#include <osgDB/FileNameUtils>
+#include <osgDB/FileUtils>
+#include <osgDB/WriteFile>
+#include <fstream>
+#include <cstring>
+#include <vector>
+#include <set>
+
+#define LC "[osgearth_buildings_atlas] "
+
+using namespace osgEarth;
+
+namespace
+{
+    int usage(const char* name, const std::string& message)
+    {
+        OE_NOTICE
+            << "\n" << message << "\n\n"
+            << "Usage: " << name << "\n"
+            << "    --in <catalog.xml>     : resource catalog to read\n"
+            << "    --out <catalog.xml>    : rewritten catalog to write; texture arrays are\n"
+            << "                             written to the same folder\n"
+            << "    [--size <n>]           : layer size in pixels, power of two (default = 512)\n"
+            << "    [--max-layers <n>]     : maximum layers per array (default = 256)\n"
+            << std::endl;
+        return -1;
+    }
+
+    bool isPowerOfTwo(unsigned n)
+    {
+        return n > 0 && (n & (n-1)) == 0;
+    }
+
+    /**
+     * Builds a box-filtered mipmap chain for a square, power-of-two RGBA8
+     * image and stores it in the image's own mipmap data.
+     */
+    void buildMipmaps(osg::Image* image)
+    {
+        unsigned size = image->s();
+
+        // total size of all levels:
+        unsigned totalBytes = 0;
+        for(unsigned s = size; s >= 1; s >>= 1)
+            totalBytes += s*s*4;
+
+        unsigned char* data = new unsigned char[totalBytes];
+        ::memcpy(data, image->data(), size*size*4);
+
+        osg::Image::MipmapDataType offsets;
+
+        unsigned srcOffset = 0;
+        unsigned dstOffset = size*size*4;
+
+        for(unsigned s = size>>1; s >= 1; s >>= 1)
+        {
+            offsets.push_back(dstOffset);
+
+            const unsigned char* src = data + srcOffset;
+            unsigned char*       dst = data + dstOffset;
+            unsigned srcSize = s << 1;
+
+            for(unsigned t=0; t<s; ++t)
+            {
+                for(unsigned r=0; r<s; ++r)
+                {
+                    const unsigned char* p00 = src + (((2*t  )*srcSize) + (2*r  ))*4;
+                    const unsigned char* p01 = src + (((2*t  )*srcSize) + (2*r+1))*4;
+                    const unsigned char* p10 = src + (((2*t+1)*srcSize) + (2*r  ))*4;
+                    const unsigned char* p11 = src + (((2*t+1)*srcSize) + (2*r+1))*4;
+                    unsigned char* q = dst + ((t*s) + r)*4;
+                    for(unsigned c=0; c<4; ++c)
+                        q[c] = (unsigned char)(((unsigned)p00[c] + p01[c] + p10[c] + p11[c] + 2u) >> 2);
+                }
+            }
+
+            srcOffset = dstOffset;
+            dstOffset += s*s*4;
+        }
+
+        image->setImage(
+            size, size, 1,
+            GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE,
+            data,
+            osg::Image::USE_NEW_DELETE);
+
+        image->setMipmapLevels(offsets);
+    }
+
+    /**
+     * Loads a skin image and conforms it to an RGBA8 layer of the given size.
+     */
+    osg::Image* createLayer(const URI& uri, unsigned size, const osgDB::Options* dbo)
+    {
+        osg::ref_ptr<osg::Image> image = uri.getImage(dbo);
+        if ( !image.valid() )
+            return 0L;
+
+        osg::ref_ptr<osg::Image> rgba = ImageUtils::convertToRGBA8(image.get());
+        if ( !rgba.valid() )
+            return 0L;
+
+        osg::ref_ptr<osg::Image> layer;
+        if ( rgba->s() != (int)size || rgba->t() != (int)size )
+        {
+            if ( !ImageUtils::resizeImage(rgba.get(), size, size, layer) )
+                return 0L;
+        }
+        else
+        {
+            layer = rgba.get();
+        }
+
+        buildMipmaps( layer.get() );
+
+        layer->setFileName( uri.full() );
+        return layer.release();
+    }
+
+    /**
+     * Rewrites a url that is relative to the input folder so that it
+     * resolves to the same file from the output folder. Both folders
+     * must exist.
+     */
+    std::string rebaseURL(const std::string& url, const std::string& inDir, const std::string& outDir)
+    {
+        if ( url.empty() || osgDB::containsServerAddress(url) || osgDB::isAbsolutePath(url) )
+            return url;
+
+        return osgDB::getPathRelative(
+            osgDB::getRealPath(outDir),
+            osgDB::concatPaths(osgDB::getRealPath(inDir), url) );
+    }
+
+    struct Skin
+    {
+        Config* conf;
+        std::string url;
+        osg::ref_ptr<osg::Image> layer;
+    };
+}
+
+
+int
+main(int argc, char** argv)
+{
+    osg::ArgumentParser arguments(&argc, argv);
+
+    std::string inFile;
+    if ( !arguments.read("--in", inFile) )
+        return usage(argv[0], "Missing required --in");
+
+    std::string outFile;
+    if ( !arguments.read("--out", outFile) )
+        return usage(argv[0], "Missing required --out");
+
+    unsigned size = 512u;
+    arguments.read("--size", size);
+    if ( !isPowerOfTwo(size) )
+        return usage(argv[0], "--size must be a power of two");
+
+    unsigned maxLayers = 256u;
+    arguments.read("--max-layers", maxLayers);
+    if ( maxLayers == 0u )
+        return usage(argv[0], "--max-layers must be positive");
+
+    // Read the catalog as raw configuration so we can rewrite it
+    // without losing anything we don't know about.
+    URI inURI(inFile);
+    osg::ref_ptr<XmlDocument> xml = XmlDocument::load(inURI);
+    if ( !xml.valid() )
+        return usage(argv[0], "Failed to load catalog " + inFile);
+
+    Config conf = xml->getConfig();
+    Config* root = conf.key() == "resources" ? &conf : conf.mutable_child("resources");
+    if ( !root )
+        return usage(argv[0], "Catalog has no <resources> element");
+
+    // Load every skin into a layer.
+    std::vector<Skin> skins;
+    for(ConfigSet::iterator i = root->children().begin(); i != root->children().end(); ++i)
+    {
+        if ( i->key() != "skin" || !i->hasValue("url") )
+            continue;
+
+        URI uri(i->value("url"), URIContext(inURI.full()));
+
+        Skin skin;
+        skin.conf  = &(*i);
+        skin.url   = uri.full();
+        skin.layer = createLayer(uri, size, 0L);
+
+        if ( skin.layer.valid() )
+        {
+            skins.push_back( skin );
+            OE_NOTICE << LC << "Packed " << i->value("name") << " (" << skin.url << ")\n";
+        }
+        else
+        {
+            OE_WARN << LC << "Failed to load " << skin.url << "; leaving it out of the atlas\n";
+        }
+    }
+
+    if ( skins.empty() )
+        return usage(argv[0], "No skins to pack");
+
+    std::string outDir = osgDB::getFilePath(outFile);
+    if ( !outDir.empty() )
+        osgDB::makeDirectory(outDir);
+
+    std::string baseName = osgDB::getStrippedName(outFile);
+
+    // Everything that stays where it was must still resolve from the new catalog.
+    std::set<const Config*> packed;
+    for(unsigned i = 0; i < skins.size(); ++i)
+        packed.insert( skins[i].conf );
+
+    std::string inDir = osgDB::getFilePath(inFile);
+    for(ConfigSet::iterator i = root->children().begin(); i != root->children().end(); ++i)
+    {
+        if ( packed.find(&(*i)) == packed.end() && i->hasValue("url") )
+        {
+            i->set("url", rebaseURL(i->value("url"), inDir.empty() ? "." : inDir, outDir.empty() ? "." : outDir));
+        }
+    }
+
+    // Split into as many arrays as needed to honor the layer limit.
+    unsigned numArrays = (skins.size() + maxLayers - 1) / maxLayers;
+    for(unsigned a = 0; a < numArrays; ++a)
+    {
+        unsigned first = a * maxLayers;
+        unsigned count = std::min(maxLayers, (unsigned)skins.size() - first);
+
+        osg::ref_ptr<osg::Texture2DArray> tex = new osg::Texture2DArray();
+        tex->setTextureSize(size, size, count);
+        tex->setWrap(osg::Texture::WRAP_S, osg::Texture::REPEAT);
+        tex->setWrap(osg::Texture::WRAP_T, osg::Texture::REPEAT);
+        tex->setFilter(osg::Texture::MIN_FILTER, osg::Texture::LINEAR_MIPMAP_LINEAR);
+        tex->setFilter(osg::Texture::MAG_FILTER, osg::Texture::LINEAR);
+        tex->setUseHardwareMipMapGeneration(false);
+        tex->setResizeNonPowerOfTwoHint(false);
+        tex->setMaxAnisotropy(4.0f);
+
+        std::string arrayName = Stringify() << baseName << "_atlas_" << a << ".osgb";
+
+        for(unsigned layer = 0; layer < count; ++layer)
+        {
+            Skin& skin = skins[first+layer];
+            tex->setImage(layer, skin.layer.get());
+
+            // Rewrite the skin so that it references its layer in the array.
+            skin.conf->set("url",           arrayName);
+            skin.conf->set("image_layer",   toString(layer));
+            skin.conf->set("image_bias_s",  toString(0.0f));
+            skin.conf->set("image_bias_t",  toString(0.0f));
+            skin.conf->set("image_scale_s", toString(1.0f));
+            skin.conf->set("image_scale_t", toString(1.0f));
+        }
+
+        std::string arrayFile = osgDB::concatPaths(outDir, arrayName);
+        if ( !osgDB::writeObjectFile(*tex.get(), arrayFile) )
+        {
+            OE_WARN << LC << "Failed to write " << arrayFile << std::endl;
+            return -1;
+        }
+
+        OE_NOTICE << LC << "Wrote " << arrayFile << " (" << count << " layers)\n";
+    }
+
+    // Write the rewritten catalog.
+    std::ofstream out(outFile.c_str());
+    if ( !out.is_open() )
+    {
+        OE_WARN << LC << "Failed to open " << outFile << " for writing" << std::endl;
+        return -1;
+    }
+
+    osg::ref_ptr<XmlDocument> outXml = new XmlDocument(*root);
+    outXml->store(out);
+    out.close();
+
+    OE_NOTICE << LC << "Wrote " << outFile << std::endl;
+
+    return 0;
+}
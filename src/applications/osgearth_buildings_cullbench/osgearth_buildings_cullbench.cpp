@@ -0,0 +1,346 @@
+/* -*-c++-*- */
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/**
+ * Headless benchmark for the cull side of instanced models.
+ *
+ * Scatters a synthetic instance set over a square area, builds it with the
+ * ModelInstancer (once with culling cells and once as large buffer-sized
+ * chunks, which is how instances were drawn before cells), and runs the
+ * OSG cull along a few scripted camera paths. No graphics context is needed.
+ *
+ * For each path it reports, per frame on average, the number of cells that
+ * survived the cull, the number of instances submitted for drawing, and the
+ * number of instances that are actually in view and in range.
+ *
+ * Usage:
+ *   osgearth_buildings_cullbench [--instances 50000] [--extent 4000]
+ *                                [--cell 256] [--range 1500] [--frames 200]
+ *                                [--seed 1]
+ */
+
+#include <osgEarthBuildings/ModelInstancer>
+#include <osgEarth/Notify>
+#include <osgEarth/StringUtils>
+#include <osg/ArgumentParser>
+#include <osg/Geode>
+#include <osg/Geometry>
+#include <osg/Polytope>
+#include <osg/Timer>
+#include <osg/Viewport>
+#include <osgUtil/CullVisitor>
+#include <osgUtil/RenderStage>
+#include <osgUtil/StateGraph>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+#include <cfloat>
+#include <cmath>
+
+#define LC "[osgearth_buildings_cullbench] "
+
+using namespace osgEarth;
+using namespace osgEarth::Buildings;
+
+namespace
+{
+    const unsigned WIDTH  = 1920u;
+    const unsigned HEIGHT = 1080u;
+
+    int usage(const char* name, const std::string& message)
+    {
+        OE_NOTICE
+            << "\n" << message << "\n\n"
+            << "Usage: " << name << "\n"
+            << "    [--instances <n>]  : number of instances to scatter (default = 50000)\n"
+            << "    [--extent <m>]     : width of the square area in meters (default = 4000)\n"
+            << "    [--cell <n>]       : maximum instances per culling cell (default = 256)\n"
+            << "    [--range <m>]      : visibility range of the instances (default = 1500)\n"
+            << "    [--frames <n>]     : frames per camera path (default = 200)\n"
+            << "    [--seed <n>]       : random seed (default = 1)\n"
+            << std::endl;
+        return -1;
+    }
+
+    // Small deterministic generator so runs are repeatable across platforms.
+    struct Random
+    {
+        unsigned _state;
+        Random(unsigned seed) : _state(seed ? seed : 1u) { }
+        double next()
+        {
+            _state = _state * 1664525u + 1013904223u;
+            return (double)(_state >> 8) / (double)(1u << 24);
+        }
+    };
+
+    // A 10x10x10m box, standing in for an instanced model.
+    osg::Node* createModel()
+    {
+        osg::Vec3Array* verts = new osg::Vec3Array();
+        for(unsigned k=0; k<8; ++k)
+            verts->push_back( osg::Vec3f((k&1)? 5 : -5, (k&2)? 5 : -5, (k&4)? 10 : 0) );
+
+        const GLushort indices[36] = {
+            0,2,1, 1,2,3,  4,5,6, 5,7,6,  0,1,4, 1,5,4,
+            2,6,3, 3,6,7,  0,4,2, 2,4,6,  1,3,5, 3,7,5 };
+
+        osg::Geometry* geom = new osg::Geometry();
+        geom->setUseVertexBufferObjects( true );
+        geom->setUseDisplayList( false );
+        geom->setVertexArray( verts );
+        geom->addPrimitiveSet( new osg::DrawElementsUShort(GL_TRIANGLES, 36, indices) );
+
+        osg::Geode* geode = new osg::Geode();
+        geode->addDrawable( geom );
+        return geode;
+    }
+
+    struct Camera
+    {
+        osg::Matrix view;
+        osg::Matrix proj;
+    };
+
+    typedef std::vector<Camera> Path;
+
+    Path createPath(const std::string& name, double extent, unsigned frames)
+    {
+        Path path;
+        double half = 0.5 * extent;
+        osg::Matrix proj = osg::Matrix::perspective( 45.0, (double)WIDTH/(double)HEIGHT, 1.0, 100000.0 );
+
+        for(unsigned f=0; f<frames; ++f)
+        {
+            double t = frames > 1 ? (double)f / (double)(frames-1) : 0.0;
+            osg::Vec3d eye, center;
+
+            if ( name == "street" )
+            {
+                // walking down the middle of the area at eye level
+                eye.set( -half + t*extent, 0.0, 2.0 );
+                center = eye + osg::Vec3d(1.0, 0.0, 0.0);
+            }
+            else if ( name == "flyover" )
+            {
+                // crossing the area diagonally, looking ahead and down
+                eye.set( -half + t*extent, -half + t*extent, 300.0 );
+                center = eye + osg::Vec3d(1.0, 1.0, -0.6);
+            }
+            else // orbit
+            {
+                // circling outside the area, looking at its center
+                double a = t * 2.0 * osg::PI;
+                eye.set( cos(a) * extent, sin(a) * extent, 500.0 );
+                center.set( 0.0, 0.0, 0.0 );
+            }
+
+            Camera camera;
+            camera.view = osg::Matrix::lookAt( eye, center, osg::Vec3d(0,0,1) );
+            camera.proj = proj;
+            path.push_back( camera );
+        }
+        return path;
+    }
+
+    struct Counts
+    {
+        double cells;
+        double submitted;
+        Counts() : cells(0.0), submitted(0.0) { }
+    };
+
+    void countLeaves(osgUtil::RenderBin* bin, Counts& counts)
+    {
+        for(osgUtil::RenderBin::RenderBinList::iterator i = bin->getRenderBinList().begin(); i != bin->getRenderBinList().end(); ++i)
+        {
+            countLeaves( i->second.get(), counts );
+        }
+
+        for(osgUtil::RenderBin::StateGraphList::iterator sg = bin->getStateGraphList().begin(); sg != bin->getStateGraphList().end(); ++sg)
+        {
+            for(osgUtil::StateGraph::LeafList::iterator leaf = (*sg)->_leaves.begin(); leaf != (*sg)->_leaves.end(); ++leaf)
+            {
+                const osg::Geometry* geom = (*leaf)->getDrawable()->asGeometry();
+                if ( geom && geom->getNumPrimitiveSets() > 0 )
+                {
+                    counts.cells += 1.0;
+                    counts.submitted += geom->getPrimitiveSet(0)->getNumInstances();
+                }
+            }
+        }
+    }
+
+    /** Runs the cull on "root" from one camera and counts what was submitted. */
+    Counts cull(osg::Node* root, const Camera& camera)
+    {
+        osg::ref_ptr<osgUtil::CullVisitor> cv = new osgUtil::CullVisitor();
+        osg::ref_ptr<osgUtil::StateGraph>  sg = new osgUtil::StateGraph();
+        osg::ref_ptr<osgUtil::RenderStage> rs = new osgUtil::RenderStage();
+        osg::ref_ptr<osg::Viewport>        vp = new osg::Viewport( 0, 0, WIDTH, HEIGHT );
+
+        cv->setComputeNearFarMode( osg::CullSettings::DO_NOT_COMPUTE_NEAR_FAR );
+        cv->setStateGraph( sg.get() );
+        cv->setRenderStage( rs.get() );
+        rs->setViewport( vp.get() );
+
+        cv->pushViewport( vp.get() );
+        cv->pushProjectionMatrix( new osg::RefMatrix(camera.proj) );
+        cv->pushModelViewMatrix( new osg::RefMatrix(camera.view), osg::Transform::ABSOLUTE_RF );
+
+        root->accept( *cv.get() );
+
+        cv->popModelViewMatrix();
+        cv->popProjectionMatrix();
+        cv->popViewport();
+
+        Counts counts;
+        countLeaves( rs.get(), counts );
+        return counts;
+    }
+
+    /** Number of instances a perfect per-instance cull would draw. */
+    unsigned countVisible(const std::vector<osg::Matrix>& matrices, float radius, float range, const Camera& camera)
+    {
+        osg::Polytope frustum;
+        frustum.setToUnitFrustum( false, false );
+        frustum.transformProvidingInverse( camera.view * camera.proj );
+
+        osg::Vec3d eye = osg::Matrix::inverse( camera.view ).getTrans();
+
+        unsigned visible = 0u;
+        for(unsigned i=0; i<matrices.size(); ++i)
+        {
+            osg::BoundingSphere bs( matrices[i].getTrans(), radius * matrices[i].getScale().x() );
+            if ( (bs.center() - eye).length() <= range && frustum.contains(bs) )
+                ++visible;
+        }
+        return visible;
+    }
+}
+
+
+int
+main(int argc, char** argv)
+{
+    osg::ArgumentParser arguments(&argc, argv);
+
+    if ( arguments.read("--help") )
+        return usage(argv[0], "Cull benchmark for instanced models");
+
+    unsigned numInstances = 50000u;
+    arguments.read("--instances", numInstances);
+
+    double extent = 4000.0;
+    arguments.read("--extent", extent);
+
+    unsigned instancesPerCell = 256u;
+    arguments.read("--cell", instancesPerCell);
+
+    float range = 1500.0f;
+    arguments.read("--range", range);
+
+    unsigned frames = 200u;
+    arguments.read("--frames", frames);
+
+    unsigned seed = 1u;
+    arguments.read("--seed", seed);
+
+    if ( numInstances == 0u || instancesPerCell == 0u || frames == 0u || extent <= 0.0 )
+        return usage(argv[0], "Arguments must be positive");
+
+    // scatter the instances:
+    Random random( seed );
+    std::vector<osg::Matrix> matrices( numInstances );
+    for(unsigned i=0; i<numInstances; ++i)
+    {
+        double s = 0.5 + random.next();
+        matrices[i] =
+            osg::Matrix::scale( s, s, s ) *
+            osg::Matrix::rotate( random.next() * 2.0 * osg::PI, osg::Vec3d(0,0,1) ) *
+            osg::Matrix::translate( (random.next()-0.5)*extent, (random.next()-0.5)*extent, 0.0 );
+    }
+
+    osg::ref_ptr<osg::Node> model = createModel();
+    float radius = model->getBound().radius();
+
+    // With cells, versus buffer-sized chunks that only the tile LOD ranges out.
+    osg::ref_ptr<osg::Node> withCells = ModelInstancer::createInstancedNode(
+        model.get(), matrices, instancesPerCell, range );
+
+    osg::ref_ptr<osg::Node> withoutCells = ModelInstancer::createInstancedNode(
+        model.get(), matrices, ModelInstancer::MAX_INSTANCES_PER_BUFFER, FLT_MAX );
+
+    OE_NOTICE << LC << numInstances << " instances over " << extent << "m, "
+        << instancesPerCell << " per cell, range " << range << "m, "
+        << frames << " frames per path\n\n";
+
+    std::cout
+        << std::left << std::setw(10) << "path"
+        << std::setw(10) << "cells"
+        << std::right
+        << std::setw(10) << "draws"
+        << std::setw(14) << "submitted"
+        << std::setw(12) << "visible"
+        << std::setw(12) << "overdraw"
+        << std::setw(12) << "cull ms"
+        << std::endl;
+
+    const char* paths[3] = { "street", "flyover", "orbit" };
+    for(unsigned p=0; p<3; ++p)
+    {
+        Path path = createPath( paths[p], extent, frames );
+
+        double visible = 0.0;
+        for(unsigned f=0; f<path.size(); ++f)
+            visible += countVisible( matrices, radius, range, path[f] );
+        visible /= (double)path.size();
+
+        for(unsigned c=0; c<2; ++c)
+        {
+            osg::Node* root = c == 0 ? withCells.get() : withoutCells.get();
+
+            Counts total;
+            osg::Timer_t start = osg::Timer::instance()->tick();
+            for(unsigned f=0; f<path.size(); ++f)
+            {
+                Counts counts = cull( root, path[f] );
+                total.cells += counts.cells;
+                total.submitted += counts.submitted;
+            }
+            double ms = osg::Timer::instance()->delta_m( start, osg::Timer::instance()->tick() ) / (double)path.size();
+
+            double draws = total.cells / (double)path.size();
+            double submitted = total.submitted / (double)path.size();
+
+            std::cout
+                << std::left << std::setw(10) << paths[p]
+                << std::setw(10) << (c == 0 ? "on" : "off")
+                << std::right << std::fixed << std::setprecision(1)
+                << std::setw(10) << draws
+                << std::setw(14) << submitted
+                << std::setw(12) << visible
+                << std::setw(12) << (visible > 0.0 ? submitted / visible : 0.0)
+                << std::setw(12) << std::setprecision(3) << ms
+                << std::endl;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,202 @@
+/* -*-c++-*- */
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/**
+ * Writes a block-compressed (BC1), pre-mipmapped .dds file next to every
+ * skin image in a building resource catalog. The catalog itself does not
+ * change: the layer's texture cache picks up the .dds counterpart of a skin
+ * image when there is one.
+ *
+ * Skins with transparency, and skins already packed into a texture array
+ * by osgearth_buildings_atlas, are left alone.
+ *
+ * With --verify nothing is written; instead every existing .dds is read
+ * back through osgDB, decoded on the CPU and compared to its source image.
+ * The tool fails if any skin falls below the PSNR threshold, so it can run
+ * in a build without a GPU.
+ *
+ * Usage:
+ *   osgearth_buildings_dds --in catalog.xml [--size 1024]
+ *                          [--verify] [--min-psnr 30]
+ */
+
+#include <osgEarthBuildings/SkinCompressor>
+#include <osgEarth/Notify>
+#include <osgEarth/URI>
+#include <osgEarth/XmlUtils>
+#include <osgEarth/ImageUtils>
+#include <osg/ArgumentParser>
+#include <osg/Timer>
+#include <osgDB/FileUtils>
+#include <osgDB/Options>
+#include <osgDB/ReadFile>
+#include <osgDB/WriteFile>
+#include <iomanip>
+
+#define LC "[osgearth_buildings_dds] "
+
+using namespace osgEarth;
+using namespace osgEarth::Buildings;
+
+namespace
+{
+    int usage(const char* name, const std::string& message)
+    {
+        OE_NOTICE
+            << "\n" << message << "\n\n"
+            << "Usage: " << name << "\n"
+            << "    --in <catalog.xml>     : resource catalog whose skins to compress\n"
+            << "    [--size <n>]           : largest size in pixels (default = no limit)\n"
+            << "    [--verify]             : check the existing .dds files instead of writing them\n"
+            << "    [--min-psnr <db>]      : lowest acceptable PSNR (default = 30)\n"
+            << std::endl;
+        return -1;
+    }
+
+    /**
+     * The source image at the size of its compressed version, for comparing.
+     */
+    osg::Image* conform(const osg::Image* source, const osg::Image* compressed)
+    {
+        osg::ref_ptr<osg::Image> rgba = ImageUtils::convertToRGBA8(source);
+        if ( !rgba.valid() )
+            return 0L;
+
+        if ( rgba->s() == compressed->s() && rgba->t() == compressed->t() )
+            return rgba.release();
+
+        osg::ref_ptr<osg::Image> resized;
+        if ( !ImageUtils::resizeImage(rgba.get(), compressed->s(), compressed->t(), resized) )
+            return 0L;
+        return resized.release();
+    }
+}
+
+
+int
+main(int argc, char** argv)
+{
+    osg::ArgumentParser arguments(&argc, argv);
+
+    std::string inFile;
+    if ( !arguments.read("--in", inFile) )
+        return usage(argv[0], "Missing required --in");
+
+    unsigned size = 0u;
+    arguments.read("--size", size);
+
+    bool verify = arguments.read("--verify");
+
+    double minPSNR = 30.0;
+    arguments.read("--min-psnr", minPSNR);
+
+    URI inURI(inFile);
+    osg::ref_ptr<XmlDocument> xml = XmlDocument::load(inURI);
+    if ( !xml.valid() )
+        return usage(argv[0], "Failed to load catalog " + inFile);
+
+    Config conf = xml->getConfig();
+    const Config* root = conf.key() == "resources" ? &conf : conf.child_ptr("resources");
+    if ( !root )
+        return usage(argv[0], "Catalog has no <resources> element");
+
+    // The OSG DDS writer flips bottom-up images by default, but the reader
+    // does not flip them back; keep the rows in OSG order so the texture
+    // samples exactly like the image it replaces.
+    osg::ref_ptr<osgDB::Options> writeOptions = new osgDB::Options("ddsNoAutoFlipWrite");
+
+    unsigned numSkins = 0u, numFailed = 0u;
+    double sourceBytes = 0.0, compressedBytes = 0.0;
+    osg::Timer_t start = osg::Timer::instance()->tick();
+
+    for(ConfigSet::const_iterator i = root->children().begin(); i != root->children().end(); ++i)
+    {
+        if ( i->key() != "skin" || !i->hasValue("url") || i->hasValue("image_layer") )
+            continue;
+
+        URI uri(i->value("url"), URIContext(inURI.full()));
+        std::string ddsFile = SkinCompressor::getCompressedFileName(uri.full());
+
+        osg::ref_ptr<osg::Image> source = uri.getImage();
+        if ( !source.valid() )
+        {
+            OE_WARN << LC << "Failed to load " << uri.full() << std::endl;
+            ++numFailed;
+            continue;
+        }
+
+        osg::ref_ptr<osg::Image> compressed;
+        if ( verify )
+        {
+            if ( !osgDB::fileExists(ddsFile) )
+            {
+                OE_NOTICE << LC << "No " << ddsFile << "; skipped\n";
+                continue;
+            }
+            compressed = osgDB::readImageFile(ddsFile);
+            if ( !compressed.valid() )
+            {
+                OE_WARN << LC << "Failed to read " << ddsFile << std::endl;
+                ++numFailed;
+                continue;
+            }
+        }
+        else
+        {
+            compressed = SkinCompressor::compress(source.get(), size);
+            if ( !compressed.valid() )
+            {
+                OE_NOTICE << LC << "Cannot compress " << uri.full() << "; skipped\n";
+                continue;
+            }
+            if ( !osgDB::writeImageFile(*compressed.get(), ddsFile, writeOptions.get()) )
+            {
+                OE_WARN << LC << "Failed to write " << ddsFile << std::endl;
+                ++numFailed;
+                continue;
+            }
+        }
+
+        osg::ref_ptr<osg::Image> decoded  = SkinCompressor::decompress(compressed.get());
+        osg::ref_ptr<osg::Image> original = conform(source.get(), compressed.get());
+        double psnr = SkinCompressor::psnr(decoded.get(), original.get());
+
+        sourceBytes     += (double)source->s() * source->t() * 4.0 * 4.0/3.0; // RGBA8 + mipmaps
+        compressedBytes += (double)compressed->getTotalSizeInBytesIncludingMipmaps();
+        ++numSkins;
+
+        bool ok = decoded.valid() && original.valid() && compressed->isMipmap() && psnr >= minPSNR;
+        if ( !ok )
+            ++numFailed;
+
+        OE_NOTICE << LC << (ok ? "" : "FAILED ") << ddsFile
+            << " (" << compressed->s() << "x" << compressed->t()
+            << ", " << compressed->getNumMipmapLevels() << " levels"
+            << ", PSNR " << std::fixed << std::setprecision(1) << psnr << " dB)\n";
+    }
+
+    double seconds = osg::Timer::instance()->delta_s(start, osg::Timer::instance()->tick());
+
+    OE_NOTICE << LC << numSkins << " skins, " << numFailed << " failed, "
+        << std::fixed << std::setprecision(2)
+        << (sourceBytes/1048576.0) << " MB as RGBA8 -> " << (compressedBytes/1048576.0) << " MB as BC1, "
+        << seconds << " s" << std::endl;
+
+    return numFailed > 0u ? -1 : 0;
+}
@@ -0,0 +1,217 @@
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "ArtCache"
+#include <OpenThreads/ScopedLock>
+#include <algorithm>
+#include <vector>
+
+using namespace osgEarth;
+using namespace osgEarth::Buildings;
+
+#define LC "[ArtCache] "
+
+// Time between housekeeping passes (milliseconds)
+#define TEND_INTERVAL_MS 1000u
+
+namespace
+{
+    struct Candidate
+    {
+        osg::Timer_t lastUsed;
+        std::string  key;
+        bool operator < (const Candidate& rhs) const { return lastUsed < rhs.lastUsed; }
+    };
+}
+
+ArtCache::ArtCache() :
+_bytes     ( 0.0 ),
+_maxBytes  ( 0.0 ),
+_expiryTime( 10.0 ),
+_hits      ( 0u ),
+_misses    ( 0u ),
+_evictions ( 0u ),
+_quit      ( false )
+{
+    _housekeeper = new Housekeeper(this);
+    _housekeeper->start();
+}
+
+ArtCache::~ArtCache()
+{
+    _mutex.lock();
+    _quit = true;
+    _wake.broadcast();
+    _mutex.unlock();
+
+    _housekeeper->join();
+    delete _housekeeper;
+}
+
+void
+ArtCache::setMaxBytes(double value)
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    _maxBytes = value;
+}
+
+double
+ArtCache::getMaxBytes() const
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    return _maxBytes;
+}
+
+void
+ArtCache::setExpiryTime(double value)
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    _expiryTime = value;
+}
+
+double
+ArtCache::getExpiryTime() const
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    return _expiryTime;
+}
+
+osgDB::ReaderWriter::ReadResult
+ArtCache::readImage(const std::string& filename, const osgDB::Options* options)
+{
+    _mutex.lock();
+    Entries::iterator i = _entries.find(filename);
+    if ( i != _entries.end() )
+    {
+        ++_hits;
+        i->second.lastUsed = osg::Timer::instance()->tick();
+
+        // the result takes its reference before the lock is released,
+        // so the housekeeper cannot evict the image from under it.
+        osgDB::ReaderWriter::ReadResult result( i->second.image.get() );
+        _mutex.unlock();
+        return result;
+    }
+    ++_misses;
+    _mutex.unlock();
+
+    // Read without the lock; two threads may read the same image, in
+    // which case the first one cached wins.
+    osgDB::ReaderWriter::ReadResult result = osgDB::ReadFileCallback::readImage(filename, options);
+    if ( !result.validImage() )
+        return result;
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+
+    Entry& entry = _entries[filename];
+    if ( !entry.image.valid() )
+    {
+        entry.image = result.getImage();
+        entry.bytes = (double)entry.image->getTotalSizeInBytesIncludingMipmaps();
+        _bytes += entry.bytes;
+    }
+    entry.lastUsed = osg::Timer::instance()->tick();
+
+    return osgDB::ReaderWriter::ReadResult( entry.image.get() );
+}
+
+void
+ArtCache::tend()
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+
+    osg::Timer_t now = osg::Timer::instance()->tick();
+    std::vector<Candidate> candidates;
+
+    for(Entries::iterator i = _entries.begin(); i != _entries.end(); )
+    {
+        Entry& entry = i->second;
+
+        // images held elsewhere (by textures in use) count as used now.
+        if ( entry.image->referenceCount() > 1 )
+        {
+            entry.lastUsed = now;
+            ++i;
+        }
+        else if ( osg::Timer::instance()->delta_s(entry.lastUsed, now) > _expiryTime )
+        {
+            _bytes -= entry.bytes;
+            ++_evictions;
+            _entries.erase( i++ );
+        }
+        else
+        {
+            if ( _maxBytes > 0.0 )
+            {
+                Candidate c;
+                c.lastUsed = entry.lastUsed;
+                c.key      = i->first;
+                candidates.push_back( c );
+            }
+            ++i;
+        }
+    }
+
+    if ( _maxBytes <= 0.0 || _bytes <= _maxBytes )
+        return;
+
+    std::sort( candidates.begin(), candidates.end() );
+
+    for(std::vector<Candidate>::const_iterator c = candidates.begin(); c != candidates.end() && _bytes > _maxBytes; ++c)
+    {
+        Entries::iterator i = _entries.find( c->key );
+        _bytes -= i->second.bytes;
+        ++_evictions;
+        _entries.erase( i );
+    }
+
+    if ( _bytes > _maxBytes )
+    {
+        OE_DEBUG << LC << "Over budget by " << (_bytes-_maxBytes)/1048576.0 << " MB of images still in use\n";
+    }
+}
+
+void
+ArtCache::keepHouse()
+{
+    _mutex.lock();
+    while( !_quit )
+    {
+        _wake.wait( &_mutex, TEND_INTERVAL_MS );
+        if ( _quit )
+            break;
+
+        _mutex.unlock();
+        tend();
+        _mutex.lock();
+    }
+    _mutex.unlock();
+}
+
+ArtCache::Stats
+ArtCache::getStats() const
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+
+    Stats stats;
+    stats.entries   = _entries.size();
+    stats.bytes     = _bytes;
+    stats.hits      = _hits;
+    stats.misses    = _misses;
+    stats.evictions = _evictions;
+    return stats;
+}
@@ -0,0 +1,235 @@
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "BoxInstancer"
+#include "BuildingShaders"
+#include "Morton"
+#include <osgEarth/VirtualProgram>
+#include <osg/Geometry>
+#include <osg/Texture2DArray>
+#include <osg/TextureBuffer>
+#include <algorithm>
+#include <cstring>
+
+using namespace osgEarth;
+using namespace osgEarth::Buildings;
+
+#define LC "[BoxInstancer] "
+
+namespace
+{
+    // Builds the walls of the unit cube. The texture coordinates hold the
+    // position along the wall (s), the height (t), and which of the box's
+    // repeat counts applies to the wall (r: 0 = X sides, 1 = Y sides).
+    void createUnitBox(osg::Vec3Array* verts, osg::Vec3Array* normals, osg::Vec3Array* texCoords, osg::DrawElementsUShort* de)
+    {
+        const osg::Vec3f corners[4] = {
+            osg::Vec3f(0,0,0), osg::Vec3f(1,0,0), osg::Vec3f(1,1,0), osg::Vec3f(0,1,0) };
+
+        const osg::Vec3f wallNormals[4] = {
+            osg::Vec3f(0,-1,0), osg::Vec3f(1,0,0), osg::Vec3f(0,1,0), osg::Vec3f(-1,0,0) };
+
+        for(unsigned w=0; w<4; ++w)
+        {
+            const osg::Vec3f& L = corners[w];
+            const osg::Vec3f& R = corners[(w+1)%4];
+            float axis = (float)(w%2);
+            unsigned start = verts->size();
+
+            verts->push_back( L );
+            verts->push_back( R );
+            verts->push_back( R + osg::Vec3f(0,0,1) );
+            verts->push_back( L + osg::Vec3f(0,0,1) );
+
+            for(unsigned i=0; i<4; ++i)
+                normals->push_back( wallNormals[w] );
+
+            texCoords->push_back( osg::Vec3f(0, 0, axis) );
+            texCoords->push_back( osg::Vec3f(1, 0, axis) );
+            texCoords->push_back( osg::Vec3f(1, 1, axis) );
+            texCoords->push_back( osg::Vec3f(0, 1, axis) );
+
+            de->push_back( start+0 ); de->push_back( start+1 ); de->push_back( start+2 );
+            de->push_back( start+0 ); de->push_back( start+2 ); de->push_back( start+3 );
+        }
+    }
+
+    // Transforms a unit cube corner using the matrix columns stored for a box.
+    inline osg::Vec3f transformCorner(const osg::Vec4f* box, float x, float y, float z)
+    {
+        osg::Vec4f v(x, y, z, 1.0f);
+        return osg::Vec3f( v*box[0], v*box[1], v*box[2] );
+    }
+
+    // Position of a box's unit cube origin (the matrix translation).
+    inline osg::Vec3d boxOrigin(const osg::Vec4f* box)
+    {
+        return osg::Vec3d( box[0].w(), box[1].w(), box[2].w() );
+    }
+}
+
+BoxInstancer::BoxInstancer(unsigned maxBoxesPerGeometry) :
+_numBoxes( 0u ),
+_maxBoxes( osg::clampBetween(maxBoxesPerGeometry, 1u, MAX_BOXES_PER_GEOMETRY) )
+{
+    //nop
+}
+
+void
+BoxInstancer::addBox(osg::Texture*      texture,
+                     const osg::Matrix& matrix,
+                     const osg::Vec3f&  texRepeat,
+                     float              texLayer,
+                     const osg::Vec4f&  texRect)
+{
+    Texels& texels = _data[texture];
+
+    // the first three columns of the matrix, such that
+    // position.x = dot(vec4(unit, 1), column0) and so on.
+    for(unsigned c=0; c<3; ++c)
+        texels.push_back( osg::Vec4f(matrix(0,c), matrix(1,c), matrix(2,c), matrix(3,c)) );
+
+    texels.push_back( osg::Vec4f(texRepeat.x(), texRepeat.y(), texRepeat.z(), texLayer) );
+    texels.push_back( texRect );
+
+    ++_numBoxes;
+}
+
+void
+BoxInstancer::finish(osg::Group* group)
+{
+    if ( empty() )
+        return;
+
+    // one unit box shared by all the geometries:
+    osg::ref_ptr<osg::Vec3Array> verts     = new osg::Vec3Array();
+    osg::ref_ptr<osg::Vec3Array> normals   = new osg::Vec3Array();
+    osg::ref_ptr<osg::Vec3Array> texCoords = new osg::Vec3Array();
+    osg::ref_ptr<osg::DrawElementsUShort> unitElements = new osg::DrawElementsUShort( GL_TRIANGLES );
+    createUnitBox( verts.get(), normals.get(), texCoords.get(), unitElements.get() );
+
+    osg::ref_ptr<osg::Vec4Array> colors = new osg::Vec4Array();
+    colors->push_back( osg::Vec4f(1,1,1,1) );
+
+    for(TexelsByTexture::const_iterator i = _data.begin(); i != _data.end(); ++i)
+    {
+        const Texels& unsorted = i->second;
+        unsigned numBoxes = unsorted.size() / TEXELS_PER_BOX;
+
+        // all the cells of a texture share its state (and sampler):
+        osg::Geode* geode = new osg::Geode();
+        if ( i->first.valid() )
+        {
+            osg::StateSet* skin = geode->getOrCreateStateSet();
+            skin->setTextureAttributeAndModes( 0, i->first.get(), osg::StateAttribute::ON );
+            installSkinSampler( skin );
+        }
+        group->addChild( geode );
+
+        // Reorder the boxes along a Z-order curve so that each geometry covers
+        // a compact cell with a tight bound that the cull can reject.
+        osg::BoundingBox extent;
+        for(unsigned b=0; b<numBoxes; ++b)
+            extent.expandBy( boxOrigin(&unsorted[b*TEXELS_PER_BOX]) );
+
+        std::vector< std::pair<unsigned, unsigned> > order( numBoxes );
+        for(unsigned b=0; b<numBoxes; ++b)
+            order[b] = std::make_pair( mortonCode(boxOrigin(&unsorted[b*TEXELS_PER_BOX]), extent), b );
+        std::sort( order.begin(), order.end() );
+
+        Texels texels( unsorted.size() );
+        for(unsigned b=0; b<numBoxes; ++b)
+            std::copy( &unsorted[order[b].second*TEXELS_PER_BOX], &unsorted[order[b].second*TEXELS_PER_BOX] + TEXELS_PER_BOX, &texels[b*TEXELS_PER_BOX] );
+
+        // Split into cells, which also keeps the instance buffers within common TBO size limits.
+        for(unsigned first = 0; first < numBoxes; first += _maxBoxes)
+        {
+            unsigned count = std::min(_maxBoxes, numBoxes - first);
+            const osg::Vec4f* data = &texels[first * TEXELS_PER_BOX];
+
+            osg::Image* image = new osg::Image();
+            image->allocateImage( count * TEXELS_PER_BOX, 1, 1, GL_RGBA, GL_FLOAT );
+            image->setInternalTextureFormat( GL_RGBA32F_ARB );
+            ::memcpy( image->data(), data, count * TEXELS_PER_BOX * sizeof(osg::Vec4f) );
+
+            osg::TextureBuffer* tbo = new osg::TextureBuffer( image );
+            tbo->setInternalFormat( GL_RGBA32F_ARB );
+
+            osg::Geometry* geom = new osg::Geometry();
+            geom->setUseVertexBufferObjects( true );
+            geom->setUseDisplayList( false );
+            geom->setVertexArray( verts.get() );
+            geom->setNormalArray( normals.get() );
+            geom->setNormalBinding( geom->BIND_PER_VERTEX );
+            geom->setColorArray( colors.get() );
+            geom->setColorBinding( geom->BIND_OVERALL );
+            geom->setTexCoordArray( 0, texCoords.get() );
+
+            osg::DrawElementsUShort* de = new osg::DrawElementsUShort( *unitElements.get() );
+            de->setNumInstances( count );
+            geom->addPrimitiveSet( de );
+
+            geom->getOrCreateStateSet()->setTextureAttribute( TBO_UNIT, tbo );
+
+            // OSG cannot see where the instances are, so supply the bounds.
+            osg::BoundingBox bounds;
+            for(unsigned b=0; b<count; ++b)
+            {
+                const osg::Vec4f* box = data + b*TEXELS_PER_BOX;
+                for(unsigned c=0; c<8; ++c)
+                    bounds.expandBy( transformCorner(box, (float)(c&1), (float)((c>>1)&1), (float)((c>>2)&1)) );
+            }
+            geom->setInitialBound( bounds );
+
+            geode->addDrawable( geom );
+        }
+    }
+
+    _data.clear();
+}
+
+void
+BoxInstancer::installShaders(osg::StateSet* stateSet)
+{
+    if ( !stateSet ) return;
+
+    VirtualProgram* vp = VirtualProgram::getOrCreate(stateSet);
+    vp->setName("Buildings boxes");
+
+    BuildingShaders shaders;
+    shaders.load(vp, shaders.BoxVertex);
+
+    stateSet->addUniform( new osg::Uniform("oeb_box_tbo", TBO_UNIT) );
+    stateSet->addUniform( new osg::Uniform("oeb_box_skin", 0) );
+}
+
+void
+BoxInstancer::installSkinSampler(osg::StateSet* stateSet)
+{
+    if ( !stateSet ) return;
+
+    osg::StateAttribute* tex = stateSet->getTextureAttribute(0, osg::StateAttribute::TEXTURE);
+    if ( !tex ) return;
+
+    VirtualProgram* vp = VirtualProgram::getOrCreate(stateSet);
+
+    BuildingShaders shaders;
+    if ( dynamic_cast<osg::Texture2DArray*>(tex) )
+        shaders.load(vp, shaders.BoxSkin2DArray);
+    else
+        shaders.load(vp, shaders.BoxSkin2D);
+}
@@ -95,8 +95,8 @@ Building::resolveInstancedModel(BuildContext& bc)
     if ( getInstancedModelSymbol() && bc.getResourceLibrary() )
     {        
         // resolve the resource.
-        ModelResourceVector candidates;
-        bc.getResourceLibrary()->getModels( getInstancedModelSymbol(), candidates, bc.getDBOptions() );
+        const ModelResourceVector& candidates = bc.getResourceMemo()->getModels(
+            bc.getResourceLibrary(), getInstancedModelSymbol(), std::string(), bc.getDBOptions() );
         if ( !candidates.empty() )
         {
             unsigned index = Random(bc.getSeed()).next( candidates.size() );
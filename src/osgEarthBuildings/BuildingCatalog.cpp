@@ -22,6 +22,7 @@
 #include "BuildingSymbol"
 #include "BuildingVisitor"
 #include "BuildContext"
+#include "FootprintSimplifier"
 
 #include <osgEarth/XmlUtils>
 #include <osgEarth/Containers>
@@ -95,6 +96,10 @@ BuildingCatalog::createBuildings(Feature*              feature,
                     // Do initial cleaning of the footprint and install is:
                     cleanPolygon( polygon );
 
+                    // Simplify it for this LOD, if requested:
+                    if ( context.getFootprintSimplifier() )
+                        context.getFootprintSimplifier()->simplify( polygon );
+
                     // Apply the height:
                     building->setHeight( height );
 
@@ -29,6 +29,28 @@ using namespace osgEarth::Buildings;
 using namespace osgEarth::Features;
 using namespace osgEarth::Symbology;
 
+namespace
+{
+    // Size of a building for range purposes: the greater of its height
+    // and the extent of its footprint.
+    float computeSize(const ElevationVector& elevations)
+    {
+        float size = 0.0f;
+        for(ElevationVector::const_iterator e = elevations.begin(); e != elevations.end(); ++e)
+        {
+            const osg::BoundingBox& aabb = e->get()->getAxisAlignedBoundingBox();
+            if ( aabb.valid() )
+            {
+                size = osg::maximum( size, aabb.xMax()-aabb.xMin() );
+                size = osg::maximum( size, aabb.yMax()-aabb.yMin() );
+            }
+            size = osg::maximum( size, e->get()->getTop() );
+            size = osg::maximum( size, computeSize(e->get()->getElevations()) );
+        }
+        return size;
+    }
+}
+
 
 BuildingCompiler::BuildingCompiler(Session* session) :
 _session( session )
@@ -58,6 +80,11 @@ BuildingCompiler::compile(const BuildingVector& input,
 
         Building* building = i->get();
 
+        if ( !output.getCompilerSettings().getSizeBins().empty() )
+        {
+            output.setCurrentSize( computeSize(building->getElevations()) );
+        }
+
         if ( building->externalModelURI().isSet() )
         {
             addExternalModel( output, building, output.getWorldToLocal(), readOptions, progress );
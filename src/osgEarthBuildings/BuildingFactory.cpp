@@ -20,6 +20,7 @@
 #include "BuildingSymbol"
 #include "BuildingVisitor"
 #include "BuildContext"
+#include "FootprintSimplifier"
 #include "Parapet"
 
 #include <osgEarthFeatures/Session>
@@ -38,6 +39,7 @@ using namespace osgEarth::Symbology;
 BuildingFactory::BuildingFactory()
 {
     setSession( new Session(0L) );
+    _resourceMemo = new ResourceMemo();
 }
 
 void
@@ -107,6 +109,15 @@ BuildingFactory::create(Feature*               feature,
     BuildContext context;
     context.setDBOptions( readOptions );
     context.setResourceLibrary( reslib );
+    context.setResourceMemo( _resourceMemo.get() );
+
+    // Footprint simplification for this style (i.e., this LOD):
+    FootprintSimplifier simplifier(
+        buildingSymbol ? buildingSymbol->simplifyTolerance().get() : 0.0f,
+        buildingSymbol ? buildingSymbol->squareAngle().get() : 0.0f );
+
+    if ( buildingSymbol && buildingSymbol->simplifyTolerance().get() > 0.0f )
+        context.setFootprintSimplifier( &simplifier );
 
     // URI context for external models
     URIContext uriContext( readOptions );
@@ -263,6 +274,12 @@ BuildingFactory::create(Feature*               feature,
         progress->stats("factory.clamp")  += clampTime;
         progress->stats("factory.symbol") += symbolTime;
         progress->stats("factory.create") += createTime;
+
+        if ( context.getFootprintSimplifier() )
+        {
+            progress->stats("# footprint points in")  += simplifier.getNumPointsIn();
+            progress->stats("# footprint points out") += simplifier.getNumPointsOut();
+        }
     }
 
     return true;
@@ -202,6 +202,12 @@ BuildingLayer::createSceneGraph()
 
     pager->build();
 
+    // Warm up the shared caches while the first tiles are requested.
+    if (options().preloadResources() == true)
+    {
+        pager->startPreload(options().preloadThreads().get());
+    }
+
     if ( options().createIndex() == true )
     {
         // create a feature index.
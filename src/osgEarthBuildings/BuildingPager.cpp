@@ -18,15 +18,20 @@
  */
 #include "BuildingPager"
 #include "Analyzer"
+#include "BuildingSymbol"
+#include "HiddenFaceRemover"
+#include "Morton"
 #include <osgEarth/Registry>
 #include <osgEarthSymbology/Query>
 #include <osgEarthSymbology/StyleSheet>
 #include <osgUtil/Optimizer>
 #include <osgUtil/Statistics>
-#include <osg/Version>
 #include <osg/CullFace>
 #include <osg/Geometry>
+#include <osg/PagedLOD>
 #include <osgDB/WriteFile>
+#include <algorithm>
+#include <set>
 
 #define LC "[BuildingPager] "
 
@@ -55,36 +60,60 @@ namespace
         bool useFileCache() const { return false; }
     };
 
-    // Callback that culls unused stuff from the ObjectCache.
-    // Unfortunately we cannot use this in OSG < 3.5.1 because of an OSG threading bug;
-    // https://github.com/openscenegraph/OpenSceneGraph/commit/5b17e3bc2a0c02cf84d891bfdccf14f170ee0ec8 
-    struct TendArtCacheCallback : public osg::NodeCallback
+    // The buildings made from one feature, waiting to be compiled with the rest of the tile.
+    struct SortedBuilding
     {
-        TendArtCacheCallback(osgDB::ObjectCache* cache) : _cache(cache) { }
+        osg::ref_ptr<Feature> feature;
+        BuildingVector        buildings;
+        osg::Vec3d            position;
+        unsigned              code;
 
-        void operator()(osg::Node* node, osg::NodeVisitor* nv)
+        bool operator < (const SortedBuilding& rhs) const { return code < rhs.code; }
+    };
+    typedef std::vector<SortedBuilding> SortedBuildings;
+
+    // Loads one skin into the shared caches at each of the given sizes.
+    struct PreloadSkinTask : public TaskPool::Task
+    {
+        osg::ref_ptr<SkinResource>         _skin;
+        const std::set<unsigned>*          _sizes;
+        SkinStateSetCache*                 _skinStateSets;
+        TextureCache*                      _texCache;
+        const osgDB::Options*              _readOptions;
+        const OpenThreads::Atomic*         _canceled;
+
+        void run(unsigned worker)
         {
-            if (nv->getFrameStamp())
-            {
-                _cache->updateTimeStampOfObjectsInCacheWithExternalReferences(nv->getFrameStamp()->getReferenceTime());
-                _cache->removeExpiredObjectsInCache(10.0);
-            }
-            traverse(node, nv);
-        }        
-        
-        osg::ref_ptr<osgDB::ObjectCache> _cache;
+            for(std::set<unsigned>::const_iterator size = _sizes->begin(); size != _sizes->end() && (unsigned)*_canceled == 0u; ++size)
+                _skinStateSets->get(_skin.get(), *size, _texCache, _readOptions);
+        }
     };
 
-    struct ArtCache : public osgDB::ObjectCache
+    // Loads and prepares one instance model in the shared cache.
+    struct PreloadModelTask : public TaskPool::Task
     {
-        unsigned size() const { return this->_objectCache.size(); }
+        osg::ref_ptr<ModelResource>        _model;
+        InstanceModelCache*                _models;
+        Session*                           _session;
+        TextureCache*                      _texCache;
+        const osgDB::Options*              _readOptions;
+        const OpenThreads::Atomic*         _canceled;
+
+        void run(unsigned worker)
+        {
+            if ( (unsigned)*_canceled == 0u )
+                _models->get(_model.get(), _session, _texCache, _readOptions);
+        }
     };
 }
 
 
 BuildingPager::BuildingPager(const Profile* profile) :
 SimplePager( profile ),
-_index     ( 0L )
+_index     ( 0L ),
+_styleMinLevel( 0u ),
+_preloader ( 0L ),
+_preloadCanceled( 0u )
 {
     // Replace tiles with higher LODs.
     setAdditive( false );
@@ -94,22 +123,43 @@ _index     ( 0L )
 
     _profile = ::getenv("OSGEARTH_BUILDINGS_PROFILE") != 0L;
 
-    // An object cache for shared resources like textures, atlases, and instanced models.
-    _artCache = new ArtCache(); //osgDB::ObjectCache();
+    // A cache for shared images like skins, atlases, and model textures.
+    _artCache = new ArtCache();
 
     // Texture object cache
     _texCache = new TextureCache();
 
-#if OSG_VERSION_GREATER_OR_EQUAL(3,5,1)
-    // Read this to see why the version check exists:
-    // https://github.com/openscenegraph/OpenSceneGraph/commit/5b17e3bc2a0c02cf84d891bfdccf14f170ee0ec8
+    // Generated state, shared by all tiles so identical state is only made once
+    _stateSetCache = new StateSetCache();
 
-    // This callack expires unused items from the art cache periodically
-    this->addCullCallback(new TendArtCacheCallback(_artCache.get()));
-#endif
+    // Skin state sets, shared by all tiles
+    _skinStateSetCache = new SkinStateSetCache();
+
+    // Instance models, prepared once and shared by all tiles
+    _instanceModelCache = new InstanceModelCache(_stateSetCache.get());
+
+    // Average skin colors for proxy tiles
+    _proxyColors = new ProxyColorCache();
+
+    // Skin and model choices for each symbol, shared by all tiles
+    _resourceMemo = new ResourceMemo();
 
     this->getOrCreateStateSet()->setAttributeAndModes(
         new osg::CullFace(), osg::StateAttribute::OFF | osg::StateAttribute::PROTECTED);
+
+    // The building shaders, installed once above all the tiles.
+    _pipeline = new BuildingPipeline();
+    _pipeline->install(this->getOrCreateStateSet());
+}
+
+BuildingPager::~BuildingPager()
+{
+    if ( _preloader )
+    {
+        _preloadCanceled.exchange( 1u );
+        _preloader->join();
+        delete _preloader;
+    }
 }
 
 void
@@ -145,7 +195,8 @@ BuildingPager::setSession(Session* session)
             if ( minLOD.isSet() && !maxLOD.isSet() )
                 maxLOD = minLOD.get();
 
-            setMinLevel( minLOD.get() );
+            _styleMinLevel = minLOD.get();
+            updateMinLevel();
             setMaxLevel( maxLOD.get() );
 
             OE_INFO << LC << "Min level = " << getMinLevel() << "; max level = " << getMaxLevel() << std::endl;
@@ -175,6 +226,30 @@ BuildingPager::setCompilerSettings(const CompilerSettings& settings)
     {
         this->setRangeFactor(_compilerSettings.rangeFactor().get());
     }
+
+    // Memory budget for cached images.
+    _artCache->setMaxBytes(_compilerSettings.maxArtCacheSize().isSet() ?
+        (double)_compilerSettings.maxArtCacheSize().get() * 1048576.0 : 0.0);
+
+    // Memory budget for cached skin textures.
+    _texCache->setMaxBytes(_compilerSettings.maxTextureCacheSize().isSet() ?
+        (double)_compilerSettings.maxTextureCacheSize().get() * 1048576.0 : 0.0);
+
+    // Worker threads for clustering instances.
+    if (_compilerSettings.useClustering() == true)
+    {
+        _taskPool = new TaskPool(_compilerSettings.clusteringThreads().get());
+    }
+
+    updateMinLevel();
+}
+
+void
+BuildingPager::updateMinLevel()
+{
+    // Proxy tiles (HLOD) start this many levels above the first styled level.
+    unsigned proxyLevels = _compilerSettings.proxyLevels().get();
+    setMinLevel( _styleMinLevel > proxyLevels ? _styleMinLevel - proxyLevels : 0u );
 }
 
 void BuildingPager::setIndex(FeatureIndexBuilder* index)
@@ -188,6 +263,124 @@ BuildingPager::setElevationPool(ElevationPool* pool)
     _elevationPool = pool;
 }
 
+osgDB::Options*
+BuildingPager::createReadOptions() const
+{
+    // Install an "art cache" in the read options so that images can be 
+    // shared throughout the creation process. This is critical for sharing 
+    // textures and especially for texture atlas usage.
+    osgDB::Options* readOptions = Registry::cloneOrCreateOptions(_session->getDBOptions());
+    readOptions->setReadFileCallback(_artCache.get());
+    return readOptions;
+}
+
+void
+BuildingPager::startPreload(unsigned numThreads)
+{
+    if ( _preloader || !_session.valid() )
+        return;
+
+    _preloader = new Preloader(this, osg::maximum(numThreads, 1u));
+    _preloader->start();
+}
+
+void
+BuildingPager::preload(unsigned numThreads)
+{
+    std::string activityName("Bld preload");
+    Registry::instance()->startActivity(activityName);
+
+    OE_START_TIMER(total);
+
+    osg::ref_ptr<osgDB::Options> readOptions = createReadOptions();
+
+    // The default library, plus any that a style names outright
+    // (libraries picked by a feature expression cannot be known up front).
+    std::vector< osg::ref_ptr<ResourceLibrary> > libraries;
+    if ( _session->styles() )
+    {
+        if ( _session->styles()->getDefaultResourceLibrary() )
+            libraries.push_back( _session->styles()->getDefaultResourceLibrary() );
+
+        for(unsigned i=0; i<30; ++i)
+        {
+            const Style* style = _session->styles()->getStyle(Stringify() << i, false);
+            const BuildingSymbol* symbol = style ? style->get<BuildingSymbol>() : 0L;
+            if ( symbol && symbol->library().isSet() )
+            {
+                StringExpression expr = symbol->library().get();
+                ResourceLibrary* reslib = _session->styles()->getResourceLibrary( expr.eval() );
+                if ( reslib && std::find(libraries.begin(), libraries.end(), reslib) == libraries.end() )
+                    libraries.push_back( reslib );
+            }
+        }
+    }
+
+    // Every skin size the tiles will ask for:
+    std::set<unsigned> sizes;
+    for(unsigned lod = _styleMinLevel; lod <= getMaxLevel(); ++lod)
+        sizes.insert( _compilerSettings.getMaxTextureSize(lod) );
+
+    TaskPool::Tasks skinTasks, modelTasks;
+    for(unsigned i=0; i<libraries.size(); ++i)
+    {
+        libraries[i]->initialize( readOptions.get() );
+
+        SkinResourceVector skins;
+        libraries[i]->getSkins( skins );
+        for(SkinResourceVector::const_iterator skin = skins.begin(); skin != skins.end(); ++skin)
+        {
+            PreloadSkinTask* task = new PreloadSkinTask();
+            task->_skin          = skin->get();
+            task->_sizes         = &sizes;
+            task->_skinStateSets = _skinStateSetCache.get();
+            task->_texCache      = _texCache.get();
+            task->_readOptions   = readOptions.get();
+            task->_canceled      = &_preloadCanceled;
+            skinTasks.push_back( task );
+        }
+
+        ModelResourceVector models;
+        libraries[i]->getModels( models, readOptions.get() );
+        for(ModelResourceVector::const_iterator model = models.begin(); model != models.end(); ++model)
+        {
+            PreloadModelTask* task = new PreloadModelTask();
+            task->_model       = model->get();
+            task->_models      = _instanceModelCache.get();
+            task->_session     = _session.get();
+            task->_texCache    = _texCache.get();
+            task->_readOptions = readOptions.get();
+            task->_canceled    = &_preloadCanceled;
+            modelTasks.push_back( task );
+        }
+    }
+
+    // This thread works on the batches too.
+    osg::ref_ptr<TaskPool> pool = new TaskPool(numThreads - 1u);
+
+    OE_START_TIMER(skins);
+    pool->run( skinTasks );
+    double skinTime = OE_GET_TIMER(skins);
+
+    OE_START_TIMER(models);
+    pool->run( modelTasks );
+    double modelTime = OE_GET_TIMER(models);
+
+    Registry::instance()->endActivity(activityName);
+
+    if ( (unsigned)_preloadCanceled != 0u )
+    {
+        OE_INFO << LC << "Preload canceled\n";
+        return;
+    }
+
+    TextureCache::Stats texStats = _texCache->getStats();
+    OE_INFO << LC << "Preloaded " << libraries.size() << " libraries on " << numThreads << " threads in " << OE_GET_TIMER(total) << "s: "
+        << skinTasks.size() << " skins at " << sizes.size() << " sizes in " << skinTime << "s ("
+        << (unsigned)(texStats.bytes/1048576.0) << " MB of textures), "
+        << modelTasks.size() << " models in " << modelTime << "s\n";
+}
+
 bool
 BuildingPager::cacheReadsEnabled(const osgDB::Options* readOptions) const
 {
@@ -235,16 +428,17 @@ BuildingPager::createNode(const TileKey& tileKey, ProgressCallback* progress)
 
 
     // I/O Options to use throughout the build process.
-    // Install an "art cache" in the read options so that images can be 
-    // shared throughout the creation process. This is critical for sharing 
-    // textures and especially for texture atlas usage.
-    osg::ref_ptr<osgDB::Options> readOptions = Registry::cloneOrCreateOptions(_session->getDBOptions());
-    readOptions->setObjectCache(_artCache.get());
-    readOptions->setObjectCacheHint(osgDB::Options::CACHE_IMAGES);
+    osg::ref_ptr<osgDB::Options> readOptions = createReadOptions();
 
     // TESTING:
-    Registry::instance()->startActivity("Bld art cache", Stringify()<<((ArtCache*)(_artCache.get()))->size());
-    Registry::instance()->startActivity("Bld tex cache", Stringify() << _texCache->_cache.size());
+    ArtCache::Stats artStats = _artCache->getStats();
+    Registry::instance()->startActivity("Bld art cache", Stringify()
+        << artStats.entries << " (" << (unsigned)(artStats.bytes/1048576.0) << " MB, "
+        << artStats.evictions << " evicted)");
+    TextureCache::Stats texStats = _texCache->getStats();
+    Registry::instance()->startActivity("Bld tex cache", Stringify()
+        << texStats.entries << " (" << (unsigned)(texStats.bytes/1048576.0) << " MB, "
+        << texStats.evictions << " evicted, " << texStats.contentions << " contended)");
     Registry::instance()->startActivity("RCache skins", Stringify() << _session->getResourceCache()->getSkinStats()._entries);
     Registry::instance()->startActivity("RCache insts", Stringify() << _session->getResourceCache()->getInstanceStats()._entries);
 
@@ -254,6 +448,13 @@ BuildingPager::createNode(const TileKey& tileKey, ProgressCallback* progress)
     output.setTileKey(tileKey);
     output.setIndex(_index);
     output.setTextureCache(_texCache.get());
+    output.setInstanceModelCache(_instanceModelCache.get());
+    output.setSkinStateSetCache(_skinStateSetCache.get());
+    output.setStateSetCache(_stateSetCache.get());
+    output.setPipeline(_pipeline.get());
+    if (_taskPool.valid())
+        output.setTaskPool(_taskPool.get());
+    output.setCompilerSettings(_compilerSettings);
 
     bool canceled = false;
     bool caching = true;
@@ -273,12 +474,34 @@ BuildingPager::createNode(const TileKey& tileKey, ProgressCallback* progress)
 
     canceled = canceled || (progress && progress->isCanceled());
 
+    // Cached tiles hold their own copies of the instance models and skin state
+    // sets, which still need their shaders and samplers.
+    if (fromCache && !canceled)
+    {
+        OE_START_TIMER(postProcess);
+
+        output.postProcess(node.get(), _compilerSettings, progress);
+
+        if (progress && progress->collectStats())
+            progress->stats("pager.postProcess") = OE_GET_TIMER(postProcess);
+    }
+
     if (!node.valid() && !canceled)
     {
+        // Tiles above the first styled level are proxies, built with that level's style.
+        bool proxy = tileKey.getLOD() < _styleMinLevel;
+
         // fetch the style for this LOD:
-        std::string styleName = Stringify() << tileKey.getLOD();
+        std::string styleName = Stringify() << (proxy ? _styleMinLevel : tileKey.getLOD());
         const Style* style = _session->styles() ? _session->styles()->getStyle(styleName) : 0L;
 
+        // Simplified footprints stray from the originals by up to the tolerance.
+        const BuildingSymbol* buildingSymbol = style ? style->get<BuildingSymbol>() : 0L;
+        if (buildingSymbol && !proxy)
+        {
+            output.expandGeometricError(buildingSymbol->simplifyTolerance().get());
+        }
+
         // Create a cursor to iterator over the feature data:
         Query query;
         query.tileKey() = tileKey;
@@ -290,6 +513,7 @@ BuildingPager::createNode(const TileKey& tileKey, ProgressCallback* progress)
 
             factory->setSession(_session.get());
             factory->setCatalog(_catalog.get());
+            factory->setResourceMemo(_resourceMemo.get());
             factory->setOutputSRS(_session->getMapSRS());
 
             // Prepare the terrain envelope, for clamping.
@@ -318,6 +542,19 @@ BuildingPager::createNode(const TileKey& tileKey, ProgressCallback* progress)
             }
             canceled = canceled || !envelope.valid();
 
+            // When chunking or removing hidden faces, hold the buildings until the
+            // whole tile is in; then they can be compared and compiled in spatial order.
+            bool chunking = _compilerSettings.verticesPerChunk().isSet() && !proxy;
+            bool hiddenFaces = _compilerSettings.removeHiddenFaces() == true && !proxy;
+            SortedBuildings sorted;
+
+            // Proxy boxes merge buildings in cells of 1/64th of the tile's width;
+            // the bounding radius is about half the diagonal of the (square) tile.
+            ProxyCompiler proxies(
+                getBounds(tileKey).radius() * sqrtf(2.0f) / 64.0f,
+                _compilerSettings.proxyVertexBudget().get(),
+                _proxyColors.get() );
+
             while (cursor->hasMore() && !canceled)
             {
                 Feature* feature = cursor->nextFeature();
@@ -336,6 +573,21 @@ BuildingPager::createNode(const TileKey& tileKey, ProgressCallback* progress)
                         output.setLocalToWorld(buildings.front()->getReferenceFrame());
                     }
 
+                    if (proxy)
+                    {
+                        for (BuildingVector::const_iterator b = buildings.begin(); b != buildings.end(); ++b)
+                            proxies.add(b->get(), output, readOptions.get());
+                        continue;
+                    }
+
+                    if (chunking || hiddenFaces)
+                    {
+                        sorted.push_back(SortedBuilding());
+                        sorted.back().feature = feature;
+                        sorted.back().buildings.swap(buildings);
+                        continue;
+                    }
+
                     // for indexing, if enabled:
                     output.setCurrentFeature(feature);
 
@@ -346,6 +598,65 @@ BuildingPager::createNode(const TileKey& tileKey, ProgressCallback* progress)
                 }
             }
 
+            if (hiddenFaces && !sorted.empty() && !canceled)
+            {
+                OE_START_TIMER(hiddenFaces);
+
+                HiddenFaceRemover remover;
+                for (SortedBuildings::iterator i = sorted.begin(); i != sorted.end(); ++i)
+                {
+                    for (BuildingVector::iterator b = i->buildings.begin(); b != i->buildings.end(); ++b)
+                        remover.add(b->get(), output.getWorldToLocal());
+                }
+
+                unsigned numHidden = remover.run(_compilerSettings.instanceBoxes() == true);
+
+                if (progress && progress->collectStats())
+                {
+                    progress->stats("pager.hiddenFaces") = OE_GET_TIMER(hiddenFaces);
+                    progress->stats("# hidden triangles") = numHidden;
+                }
+            }
+
+            if (chunking && !sorted.empty() && !canceled)
+            {
+                OE_START_TIMER(sort);
+
+                // Morton-order the buildings by their position in the tile's local frame,
+                // so the batches fill up one compact chunk at a time.
+                osg::BoundingBox extent;
+                for (SortedBuildings::iterator i = sorted.begin(); i != sorted.end(); ++i)
+                {
+                    i->position = i->buildings.front()->getReferenceFrame().getTrans() * output.getWorldToLocal();
+                    extent.expandBy(i->position);
+                }
+
+                for (SortedBuildings::iterator i = sorted.begin(); i != sorted.end(); ++i)
+                {
+                    i->code = mortonCode(i->position, extent);
+                }
+
+                std::stable_sort(sorted.begin(), sorted.end());
+
+                if (progress && progress->collectStats())
+                    progress->stats("pager.sort") = OE_GET_TIMER(sort);
+            }
+
+            for (SortedBuildings::iterator i = sorted.begin(); i != sorted.end() && !canceled; ++i)
+            {
+                output.setCurrentFeature(i->feature.get());
+
+                if (!_compiler->compile(i->buildings, output, readOptions.get(), progress))
+                {
+                    canceled = true;
+                }
+            }
+
+            if (proxy && !canceled)
+            {
+                proxies.compile(output, progress);
+            }
+
             if (!canceled)
             {
                 // set the distance at which details become visible.
@@ -385,6 +696,37 @@ BuildingPager::createNode(const TileKey& tileKey, ProgressCallback* progress)
         }
     }
 
+    // Release the skins of tiles that have been paged out, if over budget.
+    if (_texCache->isOverBudget())
+    {
+        OE_START_TIMER(pruneTextures);
+
+        _skinStateSetCache->prune();
+        _texCache->prune();
+
+        if (progress && progress->collectStats())
+            progress->stats("pager.pruneTextures") = OE_GET_TIMER(pruneTextures);
+    }
+
+    if (progress && progress->collectStats())
+    {
+        texStats = _texCache->getStats();
+        progress->stats("# texcache entries") = texStats.entries;
+        progress->stats("# texcache MB") = texStats.bytes / 1048576.0;
+        progress->stats("# texcache hits") = texStats.hits;
+        progress->stats("# texcache misses") = texStats.misses;
+        progress->stats("# texcache evictions") = texStats.evictions;
+        progress->stats("# texcache contentions") = texStats.contentions;
+        progress->stats("# texcache compressed") = texStats.compressed;
+
+        artStats = _artCache->getStats();
+        progress->stats("# artcache entries") = artStats.entries;
+        progress->stats("# artcache MB") = artStats.bytes / 1048576.0;
+        progress->stats("# artcache hits") = artStats.hits;
+        progress->stats("# artcache misses") = artStats.misses;
+        progress->stats("# artcache evictions") = artStats.evictions;
+    }
+
     Registry::instance()->endActivity(activityName);
 
     double totalTime = OE_GET_TIMER(total);
@@ -407,6 +749,37 @@ BuildingPager::createNode(const TileKey& tileKey, ProgressCallback* progress)
     }
 }
 
+osg::Node*
+BuildingPager::createPagedNode(const TileKey& tileKey, ProgressCallback* progress)
+{
+    osg::Node* node = SimplePager::createPagedNode(tileKey, progress);
+
+    if (!_compilerSettings.maxScreenSpaceError().isSet())
+        return node;
+
+    // Only tiles that have children to page in, and know their error, switch by SSE.
+    osg::PagedLOD* plod = dynamic_cast<osg::PagedLOD*>(node);
+    if (!plod || plod->getNumChildren() == 0 || plod->getNumFileNames() < 2)
+        return node;
+
+    float error = CompilerOutput::readGeometricError(plod->getChild(0));
+    if (error <= 0.0f)
+        return node;
+
+    // In PIXEL_SIZE_ON_SCREEN mode the ranges are the projected diameter of the
+    // tile's bounding sphere, so the error covers error/(2*radius) of that.
+    // Refine once the error would cover more than the allowed number of pixels.
+    float maxError = osg::maximum(_compilerSettings.maxScreenSpaceError().get(), 0.1f);
+    float pixels = maxError * 2.0f * plod->getRadius() / error;
+
+    bool replace = plod->getMinRange(0) > 0.0f;
+    plod->setRangeMode(osg::LOD::PIXEL_SIZE_ON_SCREEN);
+    plod->setRange(0, 0.0f, replace ? pixels : FLT_MAX);
+    plod->setRange(1, pixels, FLT_MAX);
+
+    return node;
+}
+
 void
 BuildingPager::applyRenderSymbology(osg::Node* node, const Style& style) const
 {
@@ -0,0 +1,72 @@
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "BuildingPipeline"
+#include "BuildingShaders"
+#include "BoxInstancer"
+#include "ModelInstancer"
+#include <osg/Texture2DArray>
+
+using namespace osgEarth;
+using namespace osgEarth::Buildings;
+
+#define LC "[BuildingPipeline] "
+
+BuildingPipeline::BuildingPipeline()
+{
+    _program = new VirtualProgram();
+    _program->setName("Buildings");
+
+    BuildingShaders shaders;
+    shaders.load(_program.get(), shaders.SkinVertex);
+
+    _instances = new osg::StateSet();
+    ModelInstancer::installShaders(_instances.get());
+
+    _boxes = new osg::StateSet();
+    BoxInstancer::installShaders(_boxes.get());
+}
+
+void
+BuildingPipeline::install(osg::StateSet* rootStateSet) const
+{
+    if ( !rootStateSet ) return;
+
+    rootStateSet->setAttributeAndModes(_program.get(), osg::StateAttribute::ON);
+
+    rootStateSet->addUniform( new osg::Uniform("oeb_skin", 0) );
+
+    // quantized geometry overrides this with its own decoding scale.
+    rootStateSet->addUniform( new osg::Uniform("oeb_uv_scale", 1.0f) );
+}
+
+void
+BuildingPipeline::installSkinSampler(osg::StateSet* skinStateSet)
+{
+    if ( !skinStateSet ) return;
+
+    osg::StateAttribute* tex = skinStateSet->getTextureAttribute(0, osg::StateAttribute::TEXTURE);
+    if ( !tex ) return;
+
+    VirtualProgram* vp = VirtualProgram::getOrCreate(skinStateSet);
+
+    BuildingShaders shaders;
+    if ( dynamic_cast<osg::Texture2DArray*>(tex) )
+        shaders.load(vp, shaders.Skin2DArray);
+    else
+        shaders.load(vp, shaders.Skin2D);
+}
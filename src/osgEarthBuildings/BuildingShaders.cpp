@@ -0,0 +1,165 @@
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "BuildingShaders"
+
+using namespace osgEarth;
+using namespace osgEarth::Buildings;
+
+BuildingShaders::BuildingShaders()
+{
+    SkinVertex = "Buildings.Skin.vert.glsl";
+    _sources[SkinVertex] =
+        "#version $GLSL_VERSION_STR\n"
+        "$GLSL_DEFAULT_PRECISION_FLOAT\n"
+        "#pragma vp_entryPoint oeb_skin_vertex\n"
+        "#pragma vp_location   vertex_model\n"
+        "uniform float oeb_uv_scale;\n"
+        "out vec3 oeb_texcoord;\n"
+        "void oeb_skin_vertex(inout vec4 vertex)\n"
+        "{\n"
+        "    oeb_texcoord = vec3(gl_MultiTexCoord0.xy * oeb_uv_scale, gl_MultiTexCoord0.z);\n"
+        "}\n";
+
+    Skin2D = "Buildings.Skin2D.frag.glsl";
+    _sources[Skin2D] =
+        "#version $GLSL_VERSION_STR\n"
+        "$GLSL_DEFAULT_PRECISION_FLOAT\n"
+        "#pragma vp_entryPoint oeb_skin_sampler\n"
+        "#pragma vp_location   fragment_coloring\n"
+        "uniform sampler2D oeb_skin;\n"
+        "in vec3 oeb_texcoord;\n"
+        "void oeb_skin_sampler(inout vec4 color)\n"
+        "{\n"
+        "    color *= texture(oeb_skin, oeb_texcoord.xy);\n"
+        "}\n";
+
+    Skin2DArray = "Buildings.Skin2DArray.frag.glsl";
+    _sources[Skin2DArray] =
+        "#version $GLSL_VERSION_STR\n"
+        "$GLSL_DEFAULT_PRECISION_FLOAT\n"
+        "#pragma vp_entryPoint oeb_skin_sampler\n"
+        "#pragma vp_location   fragment_coloring\n"
+        "uniform sampler2DArray oeb_skin;\n"
+        "in vec3 oeb_texcoord;\n"
+        "void oeb_skin_sampler(inout vec4 color)\n"
+        "{\n"
+        "    color *= texture(oeb_skin, oeb_texcoord);\n"
+        "}\n";
+
+    FlatNormalsVertex = "Buildings.FlatNormals.vert.glsl";
+    _sources[FlatNormalsVertex] =
+        "#version $GLSL_VERSION_STR\n"
+        "$GLSL_DEFAULT_PRECISION_FLOAT\n"
+        "#pragma vp_entryPoint oeb_flat_normals_vertex\n"
+        "#pragma vp_location   vertex_view\n"
+        "out vec3 oeb_viewPos;\n"
+        "void oeb_flat_normals_vertex(inout vec4 vertex)\n"
+        "{\n"
+        "    oeb_viewPos = vertex.xyz / vertex.w;\n"
+        "}\n";
+
+    FlatNormalsFragment = "Buildings.FlatNormals.frag.glsl";
+    _sources[FlatNormalsFragment] =
+        "#version $GLSL_VERSION_STR\n"
+        "$GLSL_DEFAULT_PRECISION_FLOAT\n"
+        "#pragma vp_entryPoint oeb_flat_normals_fragment\n"
+        "#pragma vp_location   fragment_coloring\n"
+        "in vec3 oeb_viewPos;\n"
+        "vec3 vp_Normal; // stage global\n"
+        "void oeb_flat_normals_fragment(inout vec4 color)\n"
+        "{\n"
+        "    vp_Normal = normalize(cross(dFdx(oeb_viewPos), dFdy(oeb_viewPos)));\n"
+        "}\n";
+
+    BoxVertex = "Buildings.Box.vert.glsl";
+    _sources[BoxVertex] =
+        "#version $GLSL_VERSION_STR\n"
+        "$GLSL_DEFAULT_PRECISION_FLOAT\n"
+        "#pragma vp_entryPoint oeb_box_vertex\n"
+        "#pragma vp_location   vertex_model\n"
+        "uniform samplerBuffer oeb_box_tbo;\n"
+        "out vec3 oeb_box_uv;\n"
+        "out vec4 oeb_box_rect;\n"
+        "vec3 vp_Normal; // stage global\n"
+        "void oeb_box_vertex(inout vec4 vertex)\n"
+        "{\n"
+        "    int i = gl_InstanceID * 5;\n"
+        "    vec4 c0 = texelFetch(oeb_box_tbo, i);\n"
+        "    vec4 c1 = texelFetch(oeb_box_tbo, i+1);\n"
+        "    vec4 c2 = texelFetch(oeb_box_tbo, i+2);\n"
+        "    vec4 tex = texelFetch(oeb_box_tbo, i+3);\n"
+        "    oeb_box_rect = texelFetch(oeb_box_tbo, i+4);\n"
+        "    vertex = vec4(dot(vertex, c0), dot(vertex, c1), dot(vertex, c2), vertex.w);\n"
+        "    vp_Normal = normalize(vec3(dot(vp_Normal, c0.xyz), dot(vp_Normal, c1.xyz), dot(vp_Normal, c2.xyz)));\n"
+        "    vec3 t = gl_MultiTexCoord0.xyz;\n"
+        "    oeb_box_uv = vec3(t.x * (t.z < 0.5 ? tex.x : tex.y), t.y * tex.z, tex.w);\n"
+        "}\n";
+
+    BoxSkin2D = "Buildings.BoxSkin2D.frag.glsl";
+    _sources[BoxSkin2D] =
+        "#version $GLSL_VERSION_STR\n"
+        "$GLSL_DEFAULT_PRECISION_FLOAT\n"
+        "#pragma vp_entryPoint oeb_box_skin\n"
+        "#pragma vp_location   fragment_coloring\n"
+        "uniform sampler2D oeb_box_skin;\n"
+        "in vec3 oeb_box_uv;\n"
+        "in vec4 oeb_box_rect;\n"
+        "void oeb_box_skin(inout vec4 color)\n"
+        "{\n"
+        "    // wrap within the skin's atlas rectangle, with gradients from the\n"
+        "    // unwrapped coordinates so the wrap does not select the wrong mipmap.\n"
+        "    vec2 g = oeb_box_uv.xy * oeb_box_rect.zw;\n"
+        "    vec2 st = oeb_box_rect.xy + fract(oeb_box_uv.xy) * oeb_box_rect.zw;\n"
+        "    color *= textureGrad(oeb_box_skin, st, dFdx(g), dFdy(g));\n"
+        "}\n";
+
+    BoxSkin2DArray = "Buildings.BoxSkin2DArray.frag.glsl";
+    _sources[BoxSkin2DArray] =
+        "#version $GLSL_VERSION_STR\n"
+        "$GLSL_DEFAULT_PRECISION_FLOAT\n"
+        "#pragma vp_entryPoint oeb_box_skin\n"
+        "#pragma vp_location   fragment_coloring\n"
+        "uniform sampler2DArray oeb_box_skin;\n"
+        "in vec3 oeb_box_uv;\n"
+        "in vec4 oeb_box_rect;\n"
+        "void oeb_box_skin(inout vec4 color)\n"
+        "{\n"
+        "    vec2 g = oeb_box_uv.xy * oeb_box_rect.zw;\n"
+        "    vec2 st = oeb_box_rect.xy + fract(oeb_box_uv.xy) * oeb_box_rect.zw;\n"
+        "    color *= textureGrad(oeb_box_skin, vec3(st, oeb_box_uv.z), dFdx(g), dFdy(g));\n"
+        "}\n";
+
+    InstanceVertex = "Buildings.Instance.vert.glsl";
+    _sources[InstanceVertex] =
+        "#version $GLSL_VERSION_STR\n"
+        "$GLSL_DEFAULT_PRECISION_FLOAT\n"
+        "#pragma vp_entryPoint oeb_instance_vertex\n"
+        "#pragma vp_location   vertex_model\n"
+        "uniform samplerBuffer oeb_instance_tbo;\n"
+        "uniform int oeb_instance_offset;\n"
+        "vec3 vp_Normal; // stage global\n"
+        "void oeb_instance_vertex(inout vec4 vertex)\n"
+        "{\n"
+        "    int i = (gl_InstanceID + oeb_instance_offset) * 3;\n"
+        "    vec4 c0 = texelFetch(oeb_instance_tbo, i);\n"
+        "    vec4 c1 = texelFetch(oeb_instance_tbo, i+1);\n"
+        "    vec4 c2 = texelFetch(oeb_instance_tbo, i+2);\n"
+        "    vertex = vec4(dot(vertex, c0), dot(vertex, c1), dot(vertex, c2), vertex.w);\n"
+        "    vp_Normal = normalize(vec3(dot(vp_Normal, c0.xyz), dot(vp_Normal, c1.xyz), dot(vp_Normal, c2.xyz)));\n"
+        "}\n";
+}
@@ -26,7 +26,9 @@ OSGEARTH_REGISTER_SIMPLE_SYMBOL(building, BuildingSymbol);
 
 BuildingSymbol::BuildingSymbol(const Config& conf) :
 Symbol      ( conf ),
-_floorHeight( 3.5f )
+_floorHeight( 3.5f ),
+_simplifyTolerance( 0.0f ),
+_squareAngle( 10.0f )
 {
     mergeConfig(conf);
 }
@@ -37,7 +39,9 @@ _floorHeight ( rhs._floorHeight ),
 _heightExpr  ( rhs._heightExpr ),
 _modelURIExpr( rhs._modelURIExpr ),
 _tagsExpr    ( rhs._tagsExpr ),
-_libraryName ( rhs._libraryName )
+_libraryName ( rhs._libraryName ),
+_simplifyTolerance( rhs._simplifyTolerance ),
+_squareAngle ( rhs._squareAngle )
 {
     //nop
 }
@@ -52,6 +56,8 @@ BuildingSymbol::getConfig() const
     conf.set( "tags",         _tagsExpr );
     conf.set( "model",        _modelURIExpr );
     conf.set( "library_name", _libraryName );
+    conf.set( "simplify_tolerance", _simplifyTolerance );
+    conf.set( "square_angle", _squareAngle );
     return conf;
 }
 
@@ -63,6 +69,8 @@ BuildingSymbol::mergeConfig( const Config& conf )
     conf.get( "tags",         _tagsExpr );
     conf.get( "model",        _modelURIExpr );
     conf.get( "library_name", _libraryName );
+    conf.get( "simplify_tolerance", _simplifyTolerance );
+    conf.get( "square_angle", _squareAngle );
 }
 
 void
@@ -85,4 +93,10 @@ BuildingSymbol::parseSLD(const Config& c, Style& style)
     else if ( match(c.key(), "building-library") ) {
         style.getOrCreate<BuildingSymbol>()->library() = !c.value().empty() ? StringExpression(c.value()) : *defaults.library();
     }
+    else if ( match(c.key(), "building-simplify-tolerance") ) {
+        style.getOrCreate<BuildingSymbol>()->simplifyTolerance() = as<float>(c.value(), *defaults.simplifyTolerance());
+    }
+    else if ( match(c.key(), "building-square-angle") ) {
+        style.getOrCreate<BuildingSymbol>()->squareAngle() = as<float>(c.value(), *defaults.squareAngle());
+    }
 }
@@ -17,12 +17,16 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>
  */
 #include "CompilerOutput"
+#include "VertexQuantizer"
+#include "BuildingPipeline"
+#include "ModelInstancer"
 #include <osg/LOD>
 #include <osg/MatrixTransform>
 #include <osg/ProxyNode>
 #include <osgUtil/Optimizer>
+#include <osgUtil/MeshOptimizers>
 #include <osgEarth/ShaderGenerator>
-#include <osgEarth/DrawInstanced>
+#include <osgEarth/VirtualProgram>
 #include <osgEarth/Registry>
 #include <osgEarth/ImageUtils>
 #include <osgEarthFeatures/Session>
@@ -41,20 +45,38 @@ using namespace osgEarth::Buildings;
 #define INSTANCES_ROOT        "_oeb_inr"
 #define INSTANCE_MODEL_GROUP  "_oeb_img"
 #define INSTANCE_MODEL        "_oeb_inm"
+#define INSTANCE_MODEL_SHARED "_oeb_ins"
 #define DEBUG_ROOT            "_oeb_deb"
+#define QUANTIZED_ROOT        "_oeb_qnt"
+#define BOXES_ROOT            "_oeb_box"
+
+#define GEOMETRIC_ERROR       "oeb_geometric_error"
 
 #define USE_LODS 1
 
 CompilerOutput::CompilerOutput() :
 _range( FLT_MAX ),
+_geometricError( 0.0f ),
 _index( 0L ),
-_currentFeature( 0L )
+_currentFeature( 0L ),
+_sizeBin( ~0u ),
+_fromCache( false )
 {
     _externalModelsGroup = new osg::Group();
     _externalModelsGroup->setName(EXTERNALS_ROOT);
 
     _debugGroup = new osg::Group();
     _debugGroup->setName(DEBUG_ROOT);
+
+    _instanceModelCache = new InstanceModelCache();
+
+    _skinStateSetCache = new SkinStateSetCache();
+
+    _stateSetCache = new StateSetCache();
+
+    _pipeline = new BuildingPipeline();
+
+    _taskPool = new TaskPool(0u);
 }
 
 void
@@ -76,7 +98,7 @@ CompilerOutput::addDrawable(osg::Drawable* drawable, const std::string& tag)
     if ( !drawable )
         return;
 
-    osg::ref_ptr<osg::Geode>& geode = _geodes[tag];
+    osg::ref_ptr<osg::Geode>& geode = _geodes[GeodeKey(tag, _sizeBin)];
     if ( !geode.valid() )
     {
         geode = new osg::Geode();
@@ -89,10 +111,41 @@ CompilerOutput::addDrawable(osg::Drawable* drawable, const std::string& tag)
     }
 }
 
+GeometryBatch*
+CompilerOutput::getBatch(const std::string& tag, osg::StateSet* stateSet)
+{
+    osg::ref_ptr<GeometryBatch>& batch = _batches[BatchKey(GeodeKey(tag, _sizeBin), stateSet)];
+    if ( !batch.valid() )
+    {
+        if ( _settings.verticesPerChunk().isSet() )
+            batch = new GeometryBatch( stateSet, osg::maximum(_settings.verticesPerChunk().get(), 1u) );
+        else
+            batch = new GeometryBatch( stateSet );
+    }
+    return batch.get();
+}
+
+BoxInstancer*
+CompilerOutput::getBoxInstancer(const std::string& tag)
+{
+    osg::ref_ptr<BoxInstancer>& boxes = _boxInstancers[GeodeKey(tag, _sizeBin)];
+    if ( !boxes.valid() )
+    {
+        boxes = new BoxInstancer( _settings.instancesPerCell().get() );
+    }
+    return boxes.get();
+}
+
 void
 CompilerOutput::addInstance(ModelResource* model, const osg::Matrix& matrix)
 {
-    _instances[model].push_back( matrix );
+    addInstance( model, matrix, std::string() );
+}
+
+void
+CompilerOutput::addInstance(ModelResource* model, const osg::Matrix& matrix, const std::string& tag)
+{
+    _instances[InstanceKey(model, GeodeKey(tag, _sizeBin))].push_back( matrix );
 
     //TODO: index it. the vector needs to be a vector of pair<matrix,feature>
 }
@@ -147,6 +200,97 @@ namespace
     };
 }
 
+namespace
+{
+    // Switches all geometry to VBOs (required for instancing).
+    struct SetUseVBOs : public osg::NodeVisitor
+    {
+        SetUseVBOs() : osg::NodeVisitor(TRAVERSE_ALL_CHILDREN) { }
+        void apply(osg::Geode& geode)
+        {
+            for (unsigned i = 0; i < geode.getNumDrawables(); ++i)
+            {
+                osg::Geometry* geom = geode.getDrawable(i)->asGeometry();
+                if (geom)
+                {
+                    geom->setUseVertexBufferObjects(true);
+                    geom->setUseDisplayList(false);
+                }
+            }
+        }
+    };
+
+    // A cached tile holds its own copies of the instance models, which
+    // need post-processing like any other unshared model.
+    struct UnshareInstanceModels : public osg::NodeVisitor
+    {
+        UnshareInstanceModels() : osg::NodeVisitor(TRAVERSE_ALL_CHILDREN) { }
+        void apply(osg::Node& node)
+        {
+            if (node.getName() == INSTANCE_MODEL_SHARED)
+                node.setName(INSTANCE_MODEL);
+            traverse(node);
+        }
+    };
+}
+
+osg::Node*
+InstanceModelCache::get(ModelResource*        res,
+                        Session*              session,
+                        TextureCache*         texCache,
+                        const osgDB::Options* readOptions)
+{
+    std::string key = res->getConfig().toJSON(false);
+    {
+        Threading::ScopedMutexLock lock(_mutex);
+        std::map<std::string, osg::ref_ptr<osg::Node> >::iterator i = _cache.find(key);
+        if (i != _cache.end())
+            return i->second.get();
+    }
+
+    // Load and prepare outside the lock so that several models can load at
+    // once (e.g. when preloading); if two threads load the same one, the
+    // first one cached wins.
+
+    // Load a private copy through the session's resource cache.
+    osg::ref_ptr<osg::Node> model;
+    if (!session->getResourceCache()->cloneOrCreateInstanceNode(res, model, readOptions) || !model.valid())
+    {
+        OE_WARN << LC << "Failed to materialize resource " << res->uri()->full() << "\n";
+        return 0L;
+    }
+
+    // remove any transforms since these will screw up instancing.
+    osgUtil::Optimizer optimizer;
+    optimizer.optimize(
+        model.get(),
+        optimizer.STATIC_OBJECT_DETECTION | optimizer.FLATTEN_STATIC_TRANSFORMS);
+
+    // share texture objects with the skins and other models.
+    if (texCache)
+    {
+        ConsolidateTextures consolidate(texCache);
+        model->accept(consolidate);
+    }
+
+    Registry::instance()->shaderGenerator().run(model.get(), "Resource Model", _sscache.get());
+
+    // Tiles copy the model for instancing, sharing its arrays; so do anything
+    // that would modify them now, while the model is still private.
+    SetUseVBOs useVBOs;
+    model->accept(useVBOs);
+    model->getBound();
+
+    // marks the model as shared so post-processing leaves it alone.
+    model->setName(INSTANCE_MODEL_SHARED);
+
+    Threading::ScopedMutexLock lock(_mutex);
+    osg::ref_ptr<osg::Node>& cached = _cache[key];
+    if (!cached.valid())
+        cached = model.get();
+    return cached.get();
+}
+
 osg::Node*
 CompilerOutput::readFromCache(const osgDB::Options* readOptions, ProgressCallback* progress) const
 {
@@ -174,6 +318,11 @@ CompilerOutput::readFromCache(const osgDB::Options* readOptions, ProgressCallbac
         ConsolidateTextures consolidate(_texCache.get());
         result.getNode()->accept(consolidate);
 
+        UnshareInstanceModels unshare;
+        result.getNode()->accept(unshare);
+
+        _fromCache = true;
+
         OE_INFO << LC << "Loaded " << _name << " from the cache (key = " << cacheKey << ")\n";
         return result.releaseNode();
     }
@@ -187,16 +336,75 @@ CompilerOutput::readFromCache(const osgDB::Options* readOptions, ProgressCallbac
 osg::StateSet*
 CompilerOutput::getSkinStateSet(SkinResource* skin, const osgDB::Options* readOptions)
 {
-    osg::ref_ptr<osg::StateSet>& ss = _skinStateSetCache[skin->imageURI()->full()];
-    if (!ss.valid()) {
-        ss = new osg::StateSet();
-        osg::Texture* tex = _texCache->get(skin, readOptions);
-        if (tex) {
-            ss->setTextureAttributeAndModes(0, tex, osg::StateAttribute::ON);
+    // distant tiles use smaller textures:
+    return _skinStateSetCache->get(skin, getMaxTextureSize(), _texCache.get(), readOptions);
+}
+
+osg::Texture*
+CompilerOutput::getTexture(SkinResource* skin, const osgDB::Options* readOptions)
+{
+    return _texCache->get(skin, readOptions, getMaxTextureSize());
+}
+
+unsigned
+CompilerOutput::getMaxTextureSize() const
+{
+    return _key.valid() ? _settings.getMaxTextureSize(_key.getLOD()) : 0u;
+}
+
+osg::StateSet*
+SkinStateSetCache::get(SkinResource* skin, unsigned maxSize, TextureCache* texCache, const osgDB::Options* readOptions)
+{
+    Key key(skin->imageURI()->full(), maxSize);
+    {
+        Threading::ScopedMutexLock lock(_mutex);
+        std::map<Key, Entry>::iterator i = _cache.find(key);
+        if (i != _cache.end() && i->second.stateSet.valid()) {
+            i->second.lastUsed = osg::Timer::instance()->tick();
+            return i->second.stateSet.get();
+        }
+    }
+
+    // Load the texture without the lock so other threads can use (and load)
+    // other skins meanwhile; if two threads build the same one, the first wins.
+    osg::ref_ptr<osg::StateSet> ss = new osg::StateSet();
+    osg::Texture* tex = texCache->get(skin, readOptions, maxSize);
+    if (tex) {
+        ss->setTextureAttributeAndModes(0, tex, osg::StateAttribute::ON);
+    }
+
+    // Tiles share this StateSet, so install the sampler now rather than in postProcess.
+    BuildingPipeline::installSkinSampler(ss.get());
+
+    Threading::ScopedMutexLock lock(_mutex);
+    Entry& entry = _cache[key];
+    if (!entry.stateSet.valid()) {
+        entry.stateSet = ss.get();
+    }
+    entry.lastUsed = osg::Timer::instance()->tick();
+    return entry.stateSet.get();
+}
+
+void
+SkinStateSetCache::prune()
+{
+    Threading::ScopedMutexLock lock(_mutex);
+
+    // same grace period as the TextureCache, for callers that have not attached theirs yet.
+    osg::Timer_t now = osg::Timer::instance()->tick();
+    for (std::map<Key, Entry>::iterator i = _cache.begin(); i != _cache.end(); )
+    {
+        if (i->second.stateSet.valid() &&
+            i->second.stateSet->referenceCount() == 1 &&
+            osg::Timer::instance()->delta_s(i->second.lastUsed, now) > 10.0)
+        {
+            _cache.erase(i++);
+        }
+        else
+        {
+            ++i;
         }
-        //OE_INFO << LC << "Cached stateset for texture " << skin->getName() << "\n";
     }
-    return ss.get();
 }
 
 void
@@ -216,6 +424,129 @@ CompilerOutput::writeToCache(osg::Node* node, const osgDB::Options* writeOptions
     OE_INFO << LC << "Wrote " << _name << " to cache (key = " << cacheKey << ")\n";
 }
 
+namespace
+{
+    /** Average number of post-transform cache misses per triangle */
+    float computeACMR(const std::vector<osg::Geometry*>& geoms)
+    {
+        osgUtil::VertexCacheMissVisitor missVisitor;
+        for(unsigned i=0; i<geoms.size(); ++i)
+            missVisitor.doGeometry( *geoms[i] );
+        return missVisitor.triangles > 0 ? (float)missVisitor.misses / (float)missVisitor.triangles : 0.0f;
+    }
+
+    /** Switches a geometry's triangles back to 16-bit indices when possible */
+    void shrinkIndices(osg::Geometry* geom)
+    {
+        if ( !geom->getVertexArray() || geom->getVertexArray()->getNumElements() > 0xFFFF )
+            return;
+
+        for(unsigned p=0; p<geom->getNumPrimitiveSets(); ++p)
+        {
+            osg::DrawElementsUInt* de = dynamic_cast<osg::DrawElementsUInt*>(geom->getPrimitiveSet(p));
+            if ( de )
+            {
+                osg::DrawElementsUShort* de16 = new osg::DrawElementsUShort( de->getMode() );
+                de16->reserve( de->size() );
+                for(osg::DrawElementsUInt::const_iterator e = de->begin(); e != de->end(); ++e)
+                    de16->push_back( (GLushort)(*e) );
+                geom->setPrimitiveSet( p, de16 );
+            }
+        }
+    }
+
+    /**
+     * Welds identical vertices, reorders triangles for the post-transform
+     * vertex cache, then reorders vertices to match the order in which they
+     * are first referenced.
+     */
+    void optimizeMeshes(const std::vector<osg::Geometry*>& geoms, float& acmrBefore, float& acmrAfter)
+    {
+        acmrBefore = computeACMR( geoms );
+
+        osgUtil::IndexMeshVisitor        indexMesh;
+        osgUtil::VertexCacheVisitor      vertexCache;
+        osgUtil::VertexAccessOrderVisitor accessOrder;
+
+        for(unsigned i=0; i<geoms.size(); ++i)
+        {
+            osg::Geometry& geom = *geoms[i];
+            indexMesh.makeMesh( geom );
+            vertexCache.optimizeVertices( geom );
+            accessOrder.optimizeOrder( geom );
+            shrinkIndices( &geom );
+            geom.dirtyBound();
+        }
+
+        acmrAfter = computeACMR( geoms );
+    }
+}
+
+void
+CompilerOutput::collectGeometries(const TaggedGeodes& geodes, std::vector<osg::Geometry*>& output) const
+{
+    for(TaggedGeodes::const_iterator g = geodes.begin(); g != geodes.end(); ++g)
+    {
+        for(unsigned i=0; i<g->second->getNumDrawables(); ++i)
+        {
+            osg::Geometry* geom = g->second->getDrawable(i)->asGeometry();
+            if ( geom )
+                output.push_back( geom );
+        }
+    }
+}
+
+void
+CompilerOutput::addGeodes(osg::LOD*               lod,
+                          const TaggedGeodes&     geodes,
+                          const CompilerSettings& settings,
+                          float                   radius,
+                          const osg::Matrix*      decode) const
+{
+    for(TaggedGeodes::const_iterator g = geodes.begin(); g != geodes.end(); ++g)
+    {
+        if ( g->second->getNumDrawables() == 0 )
+            continue;
+
+        addRanged( lod, g->first, g->second.get(), settings, radius, decode );
+    }
+}
+
+void
+CompilerOutput::addRanged(osg::LOD*               lod,
+                          const GeodeKey&         key,
+                          osg::Node*              node,
+                          const CompilerSettings& settings,
+                          float                   radius,
+                          const osg::Matrix*      decode) const
+{
+    const std::string& tag = key.first;
+    const CompilerSettings::LODBin* bin = settings.getLODBin(tag);
+    //float minRange = bin && bin->minLodScale > 0.0f? g->second->getBound().radius() + _range*bin->minLodScale : 0.0f;
+    //float maxRange = bin ? g->second->getBound().radius() + _range*bin->lodScale : FLT_MAX;
+    float minRange = bin && bin->minLodScale > 0.0f? radius + _range*bin->minLodScale : 0.0f;
+    float maxRange = bin ? radius + _range*bin->lodScale : FLT_MAX;
+
+    // small buildings range out sooner:
+    const CompilerSettings::SizeBin* sizeBin = settings.getSizeBin(key.second);
+    if ( sizeBin )
+    {
+        float lodScale = bin ? bin->lodScale : 1.0f;
+        maxRange = osg::minimum( maxRange, radius + _range*lodScale*sizeBin->lodScale );
+    }
+
+    if ( decode )
+    {
+        osg::MatrixTransform* xform = new osg::MatrixTransform( *decode );
+        xform->addChild( node );
+        lod->addChild( xform, minRange, maxRange );
+    }
+    else
+    {
+        lod->addChild( node, minRange, maxRange );
+    }
+}
+
 osg::Node*
 CompilerOutput::createSceneGraph(Session*                session,
                                  const CompilerSettings& settings,
@@ -227,47 +558,127 @@ CompilerOutput::createSceneGraph(Session*                session,
     // install the master matrix for this graph:
     osg::ref_ptr<osg::MatrixTransform> root = new osg::MatrixTransform( getLocalToWorld() );
 
+    // Finish the geometry batches, collecting them into geodes by tag.
+    // Quantized batches go into their own geodes since they need decoding.
+    OE_START_TIMER(batches);
+    bool quantize = settings.quantizeVertices() == true;
+    TaggedGeodes geodes( _geodes );
+    TaggedGeodes batchGeodes;
+    for(Batches::const_iterator b = _batches.begin(); b != _batches.end(); ++b)
+    {
+        GeometryBatch* batch = b->second.get();
+        if ( batch->empty() )
+            continue;
+
+        osg::ref_ptr<osg::Geode>& geode = quantize ? batchGeodes[b->first.first] : geodes[b->first.first];
+        if ( !geode.valid() )
+        {
+            geode = new osg::Geode();
+        }
+        batch->finish( geode.get(), _index );
+    }
+    double batchTime = OE_GET_TIMER(batches);
+
+    // Optimize the meshes for the vertex cache.
+    if ( settings.optimizeVertexCache() == true )
+    {
+        OE_START_TIMER(vcache);
+
+        std::vector<osg::Geometry*> geoms;
+        collectGeometries( geodes, geoms );
+        collectGeometries( batchGeodes, geoms );
+
+        float acmrBefore = 0.0f, acmrAfter = 0.0f;
+        optimizeMeshes( geoms, acmrBefore, acmrAfter );
+
+        if ( progress && progress->collectStats() )
+        {
+            progress->stats("out.vcache") = OE_GET_TIMER(vcache);
+            progress->stats("# acmr before") = acmrBefore;
+            progress->stats("# acmr after") = acmrAfter;
+        }
+    }
+
+    // Convert the batches to compact vertex formats.
+    VertexQuantizer quantizer;
+    if ( !batchGeodes.empty() )
+    {
+        OE_START_TIMER(quantize);
+
+        std::vector<osg::Geometry*> geoms;
+        collectGeometries( batchGeodes, geoms );
+
+        for(unsigned i=0; i<geoms.size(); ++i)
+            quantizer.expandBy( geoms[i] );
+
+        for(unsigned i=0; i<geoms.size(); ++i)
+            quantizer.quantize( geoms[i] );
+
+        for(TaggedGeodes::const_iterator g = batchGeodes.begin(); g != batchGeodes.end(); ++g)
+            g->second->dirtyBound();
+
+        if ( progress && progress->collectStats() )
+        {
+            progress->stats("out.quantize") = OE_GET_TIMER(quantize);
+            progress->stats("# quantize KB saved") = quantizer.getBytesSaved() / 1024u;
+        }
+    }
+
+    const float radius = _key.valid() ? _key.getExtent().computeBoundingGeoCircle().getRadius() : 0.0f;
+
     // tagged geodes:
-    if ( !_geodes.empty() )
+    if ( !geodes.empty() )
     {
         // The Geode LOD holds each geode in its range.
         osg::LOD* geodeLOD = new osg::LOD();
         geodeLOD->setName(GEODES_ROOT);
         root->addChild( geodeLOD );
 
-        const GeoCircle bc = _key.getExtent().computeBoundingGeoCircle();
+        addGeodes( geodeLOD, geodes, settings, radius, 0L );
+    }
+
+    // quantized geodes; each one sits under a transform that decodes the positions.
+    // (The LOD stays above the transforms so its ranges are in real units.)
+    if ( !batchGeodes.empty() )
+    {
+        osg::LOD* geodeLOD = new osg::LOD();
+        geodeLOD->setName(QUANTIZED_ROOT);
+        quantizer.applyTexCoordScale( geodeLOD->getOrCreateStateSet() );
+        root->addChild( geodeLOD );
+
+        osg::Matrix decode = quantizer.getDecodeMatrix();
+        addGeodes( geodeLOD, batchGeodes, settings, radius, &decode );
+    }
+
+    // instanced boxes, one group (of a geode per texture) per tag:
+    unsigned numBoxes = 0u;
+    osg::LOD* boxLOD = 0L;
+    for(BoxInstancers::const_iterator b = _boxInstancers.begin(); b != _boxInstancers.end(); ++b)
+    {
+        if ( b->second->empty() )
+            continue;
 
-        for(TaggedGeodes::const_iterator g = _geodes.begin(); g != _geodes.end(); ++g)
+        if ( !boxLOD )
         {
-            const std::string& tag = g->first;
-            const CompilerSettings::LODBin* bin = settings.getLODBin(tag);
-            //float minRange = bin && bin->minLodScale > 0.0f? g->second->getBound().radius() + _range*bin->minLodScale : 0.0f;
-            //float maxRange = bin ? g->second->getBound().radius() + _range*bin->lodScale : FLT_MAX;
-            float minRange = bin && bin->minLodScale > 0.0f? bc.getRadius() + _range*bin->minLodScale : 0.0f;
-            float maxRange = bin ? bc.getRadius() + _range*bin->lodScale : FLT_MAX;
-            geodeLOD->addChild( g->second.get(), minRange, maxRange );
+            boxLOD = new osg::LOD();
+            boxLOD->setName(BOXES_ROOT);
+            root->addChild( boxLOD );
         }
+
+        numBoxes += b->second->getNumBoxes();
+        osg::Group* group = new osg::Group();
+        b->second->finish( group );
+        addRanged( boxLOD, b->first, group, settings, radius, 0L );
     }
 
     if ( _externalModelsGroup->getNumChildren() > 0 )
     {
         root->addChild( _externalModelsGroup.get() );
     }
-    
-    // Run an optimization pass before adding any debug data or models
-    // NOTE: be careful; don't mess with state during optimization.
-    OE_START_TIMER(optimize);
-    {
-        // because the default merge limit is 10000 and there's no other way to change it
-        osgUtil::Optimizer::MergeGeometryVisitor mergeGeometry;
-        mergeGeometry.setTargetMaximumNumberOfVertices( 250000u );
-        root->accept( mergeGeometry );
-    }
-    double optimizeTime = OE_GET_TIMER(optimize);
 
-    
     // install the model instances, creating one instance group for each model.
     OE_START_TIMER(instances);
+    unsigned numInstances = 0u;
     if (!_instances.empty())
     {
 #ifdef USE_LODS
@@ -278,64 +689,61 @@ CompilerOutput::createSceneGraph(Session*                session,
 #endif
         instances->setName(INSTANCES_ROOT);
 
-        // keeps one copy of each instanced model per resource:
-        typedef std::map< ModelResource*, osg::ref_ptr<osg::Node> > ModelNodes;
-        ModelNodes modelNodes;
-
         for(InstanceMap::const_iterator i = _instances.begin(); i != _instances.end(); ++i)
         {
-            ModelResource* res = i->first.get();
-
-            // look up or create the node corresponding to this instance:
-            osg::ref_ptr<osg::Node>& modelNode = modelNodes[res];
-            if (!modelNode.valid())
-            {                
-                // Instance models use the GLOBAL resource cache, so that an instance model gets
-                // loaded only once. Then it's cloned for each tile. That way the shader generator
-                // will never touch live data. (Note that texture images are memory-cached in the
-                // readOptions.)
-                //
-                // TODO: even though the images are shared, the texture object itself is not.
-                // So it would be great to post-process this node and consolidate its texture
-                // references with those in the global texture cache, thereby reducing the GPU
-                // memory footprint.
-                if (!session->getResourceCache()->cloneOrCreateInstanceNode(res, modelNode, readOptions))
-                {
-                    OE_WARN << LC << "Failed to materialize resource " << res->uri()->full() << "\n";
-                }
-            }
+            ModelResource* res = i->first.first.get();
+            const GeodeKey& geodeKey = i->first.second;
+
+            // Instance models are prepared once (per layer, when the pager shares its
+            // cache) and used read-only; each tile only adds its own instance buffers.
+            osg::ref_ptr<osg::Node> modelNode = _instanceModelCache->get(res, session, _texCache.get(), readOptions);
 
             if ( modelNode.valid() )
             {
-                modelNode->setName(INSTANCE_MODEL);
-
-                // remove any transforms since these will screw up instancing.
-                osgUtil::Optimizer optimizer;
-                optimizer.optimize(
-                    modelNode.get(),
-                    //optimizer.INDEX_MESH |
-                    optimizer.STATIC_OBJECT_DETECTION | optimizer.FLATTEN_STATIC_TRANSFORMS);
-
                 osg::Group* modelGroup = new osg::Group();
                 modelGroup->setName(INSTANCE_MODEL_GROUP);
 
-                // Build a normal scene graph based on MatrixTransforms, and then convert it 
-                // over to use instancing if it's available.
                 const MatrixVector& mats = i->second;
-                for(MatrixVector::const_iterator m = mats.begin(); m != mats.end(); ++m)
-                {
-                    osg::MatrixTransform* modelxform = new osg::MatrixTransform( *m );
-                    modelxform->addChild( modelNode.get() );
-                    modelGroup->addChild( modelxform );
-                }
+                numInstances += mats.size();
 
-#ifdef USE_LODS
-                // check for a display bin for this model resource:
-                const CompilerSettings::LODBin* bin = settings.getLODBin( res->tags() );
+                // check for a display bin for the instance's tag, or else the model's:
+                const CompilerSettings::LODBin* bin = geodeKey.first.empty() ?
+                    settings.getLODBin( res->tags() ) :
+                    settings.getLODBin( geodeKey.first );
                 float lodScale = bin ? bin->lodScale : 1.0f;
 
-                float maxRange = _range*lodScale;
+                // the same ranges as the tile's geodes, so instances on a building
+                // (like its roof) range out with its walls:
+                float maxRange = radius + _range*lodScale;
+
+                const CompilerSettings::SizeBin* sizeBin = settings.getSizeBin(geodeKey.second);
+                if ( sizeBin )
+                    maxRange = osg::minimum( maxRange, radius + _range*lodScale*sizeBin->lodScale );
+
+                if ( settings.useClustering() == true )
+                {
+                    // Clustering flattens a graph of MatrixTransforms into merged geometry,
+                    // so it needs a private copy of the model (sharing only the textures).
+                    osg::ref_ptr<osg::Node> copy = osg::clone( modelNode.get(),
+                        osg::CopyOp::DEEP_COPY_ALL & ~osg::CopyOp::DEEP_COPY_TEXTURES & ~osg::CopyOp::DEEP_COPY_IMAGES );
+                    copy->setName(INSTANCE_MODEL);
+
+                    for(MatrixVector::const_iterator m = mats.begin(); m != mats.end(); ++m)
+                    {
+                        osg::MatrixTransform* modelxform = new osg::MatrixTransform( *m );
+                        modelxform->addChild( copy.get() );
+                        modelGroup->addChild( modelxform );
+                    }
+                }
+                else
+                {
+                    // Draw instanced straight from the packed transforms, in cells
+                    // that cull and range out individually.
+                    modelGroup->addChild( ModelInstancer::createInstancedNode(
+                        modelNode.get(), mats, settings.instancesPerCell().get(), maxRange) );
+                }
 
+#ifdef USE_LODS
                 // find the LOD range to add it to, or create a new one if neccesary:
                 bool added = false;
                 for(unsigned i=0; i<instances->getNumChildren() && !added; ++i)
@@ -366,65 +774,246 @@ CompilerOutput::createSceneGraph(Session*                session,
 
     if ( progress && progress->collectStats() )
     {
-        progress->stats("out.optimize" ) = optimizeTime;
+        progress->stats("out.batches"  ) = batchTime;
         progress->stats("out.instances") = instanceTime;
         progress->stats("out.total")     = OE_GET_TIMER(total);
+        progress->stats("# instanced boxes") = numBoxes;
+        progress->stats("# instances") = numInstances;
+
+        progress->stats("# roof triangle")  = _roofTessellator.getCount(RoofTessellator::PATH_TRIANGLE);
+        progress->stats("# roof rectangle") = _roofTessellator.getCount(RoofTessellator::PATH_RECTANGLE);
+        progress->stats("# roof convex")    = _roofTessellator.getCount(RoofTessellator::PATH_CONVEX);
+        progress->stats("# roof ear clip")  = _roofTessellator.getCount(RoofTessellator::PATH_EAR_CLIP);
+        progress->stats("# roof fallback")  = _roofTessellator.getCount(RoofTessellator::PATH_FALLBACK);
+    }
+
+    // record the geometric error for screen-space-error paging (survives the cache).
+    if ( _geometricError > 0.0f )
+    {
+        root->setUserValue( GEOMETRIC_ERROR, _geometricError );
     }
 
     return root.release();
 }
 
+float
+CompilerOutput::readGeometricError(const osg::Node* node)
+{
+    float error = 0.0f;
+    if ( node )
+    {
+        node->getUserValue( GEOMETRIC_ERROR, error );
+    }
+    return error;
+}
+
 namespace
 {
+    /** Clustering time spent by each worker of a TaskPool */
+    struct ClusteringTimes
+    {
+        Threading::Mutex    _mutex;
+        std::vector<double> _seconds;
+
+        void add(unsigned worker, double seconds)
+        {
+            Threading::ScopedMutexLock lock(_mutex);
+            if (worker >= _seconds.size())
+                _seconds.resize(worker+1u, 0.0);
+            _seconds[worker] += seconds;
+        }
+    };
+
+    /** Clusters (flattens) one group of instances. */
+    struct ClusteringTask : public TaskPool::Task
+    {
+        osg::ref_ptr<osg::Group> _group;
+        optional<unsigned>       _maxVerts;
+        ClusteringTimes*         _times;
+
+        void run(unsigned worker)
+        {
+            OE_START_TIMER(cluster);
+
+            if (_maxVerts.isSet())
+                osgEarth::Symbology::MeshFlattener::run(_group.get(), _maxVerts.get());
+            else
+                osgEarth::Symbology::MeshFlattener::run(_group.get());
+
+            _times->add(worker, OE_GET_TIMER(cluster));
+        }
+    };
+
     /**
-     * Performs all the shader component installation on the scene graph. 
-     * Once this is done the model is ready to render.
+     * Moves the instance transforms under a group of model groups into
+     * the cells of a grid, one new group per occupied cell, so that each
+     * cell clusters on its own. The transforms are kept in "holder": the
+     * instances of a model share one copy of it, and the copy must not
+     * lose parents on several threads at once.
+     */
+    void partition(osg::Group*                          group,
+                   unsigned                             gridSize,
+                   std::vector< osg::ref_ptr<osg::Node> >& holder,
+                   std::vector<osg::Group*>&            cells)
+    {
+        std::vector<osg::MatrixTransform*> xforms;
+        osg::BoundingBox extent;
+
+        for (unsigned i = 0; i < group->getNumChildren(); ++i)
+        {
+            osg::Group* modelGroup = group->getChild(i)->asGroup();
+            if (!modelGroup)
+                continue;
+
+            for (unsigned j = 0; j < modelGroup->getNumChildren(); ++j)
+            {
+                osg::MatrixTransform* xform = dynamic_cast<osg::MatrixTransform*>(modelGroup->getChild(j));
+                if (xform)
+                {
+                    xforms.push_back(xform);
+                    holder.push_back(xform);
+                    extent.expandBy(xform->getMatrix().getTrans());
+                }
+            }
+        }
+
+        double cellSize = osg::maximum(extent.xMax() - extent.xMin(), extent.yMax() - extent.yMin()) / (double)gridSize;
+
+        if (gridSize <= 1u || xforms.size() < 2u || !(cellSize > 0.0))
+        {
+            cells.push_back(group);
+            return;
+        }
+
+        for (unsigned i = 0; i < xforms.size(); ++i)
+        {
+            osg::Group* modelGroup = xforms[i]->getParent(0);
+            modelGroup->removeChild(xforms[i]);
+        }
+        group->removeChildren(0, group->getNumChildren());
+
+        std::map< std::pair<unsigned, unsigned>, osg::Group* > cellGroups;
+        for (unsigned i = 0; i < xforms.size(); ++i)
+        {
+            const osg::Vec3d& p = xforms[i]->getMatrix().getTrans();
+            unsigned x = osg::minimum((unsigned)((p.x() - extent.xMin()) / cellSize), gridSize - 1u);
+            unsigned y = osg::minimum((unsigned)((p.y() - extent.yMin()) / cellSize), gridSize - 1u);
+
+            osg::Group*& cell = cellGroups[std::make_pair(x, y)];
+            if (!cell)
+            {
+                cell = new osg::Group();
+                group->addChild(cell);
+                cells.push_back(cell);
+            }
+            cell->addChild(xforms[i]);
+        }
+    }
+
+    /**
+     * Attaches the building shader pipeline's prepared state to the scene
+     * graph. Once this is done the model is ready to render.
      */
     struct PostProcessNodeVisitor : public osg::NodeVisitor
     {
         osg::ref_ptr<StateSetCache> _sscache;
+        const BuildingPipeline* _pipeline;
+        TaskPool* _pool;
         unsigned _models, _instanceGroups, _geodes;
         bool _useDrawInstanced;
+        bool _generateShaders;
         ProgressCallback* _progress;
         const CompilerSettings* _settings;
+        std::set<osg::StateSet*> _skinStateSets;
+        bool _inSkinned;
+        bool _inBoxes;
 
-        PostProcessNodeVisitor() : osg::NodeVisitor()
+        PostProcessNodeVisitor(StateSetCache* sscache, const BuildingPipeline* pipeline, TaskPool* pool) : osg::NodeVisitor()
         {
             setTraversalMode(TRAVERSE_ALL_CHILDREN);
             setNodeMaskOverride(~0);
 
-            _sscache = new StateSetCache();
+            _sscache = sscache;
+            _pipeline = pipeline;
+            _pool = pool;
 
             _models = 0;
             _instanceGroups = 0;
             _geodes = 0;
             _useDrawInstanced = false;
+            _generateShaders = false;
+            _inSkinned = false;
+            _inBoxes = false;
+        }
+
+        void apply(osg::Geode& geode)
+        {
+            if (!_inSkinned && !_inBoxes)
+            {
+                apply(static_cast<osg::Node&>(geode));
+                return;
+            }
+
+            // Shared skin state sets (and box geodes' own) already have their
+            // sampler; only state sets read back from the cache can be missing one.
+            if (_inBoxes)
+            {
+                osg::StateSet* ss = geode.getStateSet();
+                if (ss && !ss->getAttribute(VirtualProgram::SA_TYPE) && _skinStateSets.insert(ss).second)
+                    BoxInstancer::installSkinSampler(ss);
+                return;
+            }
+
+            for (unsigned i = 0; i < geode.getNumDrawables(); ++i)
+            {
+                osg::StateSet* ss = geode.getDrawable(i)->getStateSet();
+                if (ss && !ss->getAttribute(VirtualProgram::SA_TYPE) && _skinStateSets.insert(ss).second)
+                    BuildingPipeline::installSkinSampler(ss);
+            }
         }
 
         void apply(osg::Node& node)
         {
-            if (node.getName() == GEODES_ROOT)
+            if (node.getName() == GEODES_ROOT || node.getName() == QUANTIZED_ROOT)
             {
                 _geodes++;
-                Registry::instance()->shaderGenerator().run(&node, "Building geodes", _sscache.get());
-                // no traverse necessary
+                // The base program is on the pager's root; quantized geometry
+                // only adds its texture coordinate scale (set at creation).
+                _inSkinned = true;
+                traverse(node);
+                _inSkinned = false;
+            }
+
+            else if (node.getName() == BOXES_ROOT)
+            {
+                _geodes++;
+                node.setStateSet(_pipeline->getBoxesStateSet());
+                _inBoxes = true;
+                traverse(node);
+                _inBoxes = false;
             }
 
             else if (node.getName() == INSTANCES_ROOT && _useDrawInstanced)
             {
-                DrawInstanced::install(node.getOrCreateStateSet());
+                // instance groups were built with their transforms in texture buffers
+                node.setStateSet(_pipeline->getInstancesStateSet());
                 traverse(node);
             }
 
             else if (node.getName() == INSTANCE_MODEL_GROUP && _useDrawInstanced)
             {
                 _instanceGroups++;
-                DrawInstanced::convertGraphToUseDrawInstanced(node.asGroup());
                 traverse(node);   
             }
             
+            else if (node.getName() == INSTANCE_MODEL_SHARED)
+            {
+                // shared by all tiles and already prepared; hands off.
+            }
+
             else if (node.getName() == INSTANCE_MODEL && _useDrawInstanced)
             {
+                // only found in tiles read from the cache, which hold their own copies.
                 _models++;
                 Registry::instance()->shaderGenerator().run(&node, "Resource Model", _sscache.get());
                 // no traverse necessary
@@ -437,26 +1026,51 @@ namespace
                 // Clustering:
                 osg::Group* group = node.asGroup();
 
+                // Flatten each LOD range, and each grid cell within it, individually.
+                std::vector<osg::Group*> cells;
+                std::vector< osg::ref_ptr<osg::Node> > holder;
+                unsigned gridSize = osg::maximum(_settings->clusteringGridSize().get(), 1u);
 #ifdef USE_LODS
-                // Flatten each LOD range individually.
                 for (unsigned i = 0; i<group->getNumChildren(); ++i)
                 {
                     osg::Group* instanceGroup = group->getChild(i)->asGroup();
-                    
-                    if (_settings->maxVertsPerCluster().isSet())
-                        osgEarth::Symbology::MeshFlattener::run(instanceGroup, _settings->maxVertsPerCluster().get());
-                    else
-                        osgEarth::Symbology::MeshFlattener::run(instanceGroup);                        
+                    if (instanceGroup)
+                        partition(instanceGroup, gridSize, holder, cells);
                 }
 #else
-                osgEarth::Symbology::MeshFlattener::run(group);
+                partition(group, gridSize, holder, cells);
 #endif
 
-                // Generate shaders afterwards.
-                Registry::instance()->shaderGenerator().run(&node, "Instances Root", _sscache.get());
+                // compute the bounds now, so the workers only read the shared models.
+                node.getBound();
+
+                ClusteringTimes times;
+                TaskPool::Tasks tasks;
+                for (unsigned i = 0; i < cells.size(); ++i)
+                {
+                    ClusteringTask* task = new ClusteringTask();
+                    task->_group = cells[i];
+                    task->_maxVerts = _settings->maxVertsPerCluster();
+                    task->_times = &times;
+                    tasks.push_back(task);
+                }
+
+                _pool->run(tasks);
+                tasks.clear();
+                holder.clear();
+
+                // The models were copied from the instance model cache with their
+                // shaders already generated; only cached tiles need them again.
+                if (_generateShaders)
+                    Registry::instance()->shaderGenerator().run(&node, "Instances Root", _sscache.get());
 
                 if (_progress)
+                {
                     _progress->stats("clustering") += OE_GET_TIMER(clustering);
+                    _progress->stats("# clustering tasks") += cells.size();
+                    for (unsigned i = 0; i < times._seconds.size(); ++i)
+                        _progress->stats(Stringify() << "clustering.worker" << i) += times._seconds[i];
+                }
 
                 // no traverse necessary
             }
@@ -474,8 +1088,9 @@ CompilerOutput::postProcess(osg::Node* graph, const CompilerSettings& settings,
 {
     if (!graph) return;
 
-    PostProcessNodeVisitor ppnv;
+    PostProcessNodeVisitor ppnv(_stateSetCache.get(), _pipeline.get(), _taskPool.get());
     ppnv._useDrawInstanced = !settings.useClustering().get();
+    ppnv._generateShaders = _fromCache;
     ppnv._progress = progress;
     ppnv._settings = &settings;
     graph->accept(ppnv);
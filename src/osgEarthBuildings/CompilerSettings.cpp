@@ -23,7 +23,17 @@ using namespace osgEarth::Buildings;
 
 CompilerSettings::CompilerSettings() :
 _rangeFactor  ( 6.0f ),
-_useClustering( false )
+_useClustering( false ),
+_clusteringGridSize( 1u ),
+_clusteringThreads( 2u ),
+_quantizeVertices( false ),
+_optimizeVertexCache( false ),
+_instanceGableRoofs( false ),
+_instanceBoxes( false ),
+_instancesPerCell( 256u ),
+_proxyLevels( 0u ),
+_proxyVertexBudget( 65536u ),
+_removeHiddenFaces( false )
 {
     //nop
 }
@@ -31,7 +41,24 @@ _useClustering( false )
 CompilerSettings::CompilerSettings(const CompilerSettings& rhs) :
 _rangeFactor( rhs._rangeFactor ),
 _useClustering( rhs._useClustering ),
-_lodBins( rhs._lodBins )
+_maxVertsPerCluster( rhs._maxVertsPerCluster ),
+_clusteringGridSize( rhs._clusteringGridSize ),
+_clusteringThreads( rhs._clusteringThreads ),
+_quantizeVertices( rhs._quantizeVertices ),
+_optimizeVertexCache( rhs._optimizeVertexCache ),
+_instanceGableRoofs( rhs._instanceGableRoofs ),
+_instanceBoxes( rhs._instanceBoxes ),
+_instancesPerCell( rhs._instancesPerCell ),
+_verticesPerChunk( rhs._verticesPerChunk ),
+_proxyLevels( rhs._proxyLevels ),
+_proxyVertexBudget( rhs._proxyVertexBudget ),
+_removeHiddenFaces( rhs._removeHiddenFaces ),
+_maxScreenSpaceError( rhs._maxScreenSpaceError ),
+_maxTextureCacheSize( rhs._maxTextureCacheSize ),
+_maxArtCacheSize( rhs._maxArtCacheSize ),
+_lodBins( rhs._lodBins ),
+_sizeBins( rhs._sizeBins ),
+_textureTiers( rhs._textureTiers )
 {
     //nop
 }
@@ -69,9 +96,67 @@ CompilerSettings::getLODBin(const TagSet& tags) const
     return 0L;
 }
 
+CompilerSettings::SizeBin&
+CompilerSettings::addSizeBin()
+{
+    _sizeBins.push_back(SizeBin());
+    return _sizeBins.back();
+}
+
+unsigned
+CompilerSettings::getSizeBinIndex(float size) const
+{
+    unsigned index = ~0u;
+    for(unsigned i=0; i<_sizeBins.size(); ++i)
+    {
+        if ( size <= _sizeBins[i].maxSize && (index == ~0u || _sizeBins[i].maxSize < _sizeBins[index].maxSize) )
+        {
+            index = i;
+        }
+    }
+    return index;
+}
+
+const CompilerSettings::SizeBin*
+CompilerSettings::getSizeBin(unsigned index) const
+{
+    return index < _sizeBins.size() ? &_sizeBins[index] : 0L;
+}
+
+CompilerSettings::TextureTier&
+CompilerSettings::addTextureTier()
+{
+    _textureTiers.push_back(TextureTier());
+    return _textureTiers.back();
+}
+
+unsigned
+CompilerSettings::getMaxTextureSize(unsigned level) const
+{
+    unsigned maxSize = 0u;
+    for(TextureTiers::const_iterator tier = _textureTiers.begin(); tier != _textureTiers.end(); ++tier)
+    {
+        if ( level <= tier->maxLevel && tier->maxSize > 0u && (maxSize == 0u || tier->maxSize < maxSize) )
+        {
+            maxSize = tier->maxSize;
+        }
+    }
+    return maxSize;
+}
 
 CompilerSettings::CompilerSettings(const Config& conf) :
-_rangeFactor( 6.0f )
+_rangeFactor( 6.0f ),
+_useClustering( false ),
+_clusteringGridSize( 1u ),
+_clusteringThreads( 2u ),
+_quantizeVertices( false ),
+_optimizeVertexCache( false ),
+_instanceGableRoofs( false ),
+_instanceBoxes( false ),
+_instancesPerCell( 256u ),
+_proxyLevels( 0u ),
+_proxyVertexBudget( 65536u ),
+_removeHiddenFaces( false )
 {
     const Config* bins = conf.child_ptr("bins");
     if ( bins )
@@ -84,9 +169,43 @@ _rangeFactor( 6.0f )
             bin.minLodScale = b->value("min_lod_scale", 0.0f);
         }
     }
+    const Config* sizeBins = conf.child_ptr("size_bins");
+    if ( sizeBins )
+    {
+        for(ConfigSet::const_iterator b = sizeBins->children().begin(); b != sizeBins->children().end(); ++b )
+        {
+            SizeBin& bin = addSizeBin();
+            bin.maxSize = b->value("max_size", 0.0f);
+            bin.lodScale = b->value("lod_scale", 1.0f);
+        }
+    }
+    const Config* textureTiers = conf.child_ptr("texture_tiers");
+    if ( textureTiers )
+    {
+        for(ConfigSet::const_iterator t = textureTiers->children().begin(); t != textureTiers->children().end(); ++t )
+        {
+            TextureTier& tier = addTextureTier();
+            tier.maxLevel = t->value("max_level", 0u);
+            tier.maxSize = t->value("max_size", 0u);
+        }
+    }
     conf.get("range_factor", _rangeFactor);
     conf.get("clustering", _useClustering);
     conf.get("max_verts_per_cluster", _maxVertsPerCluster);
+    conf.get("clustering_grid_size", _clusteringGridSize);
+    conf.get("clustering_threads", _clusteringThreads);
+    conf.get("quantize_vertices", _quantizeVertices);
+    conf.get("optimize_vertex_cache", _optimizeVertexCache);
+    conf.get("instance_gable_roofs", _instanceGableRoofs);
+    conf.get("instance_boxes", _instanceBoxes);
+    conf.get("instances_per_cell", _instancesPerCell);
+    conf.get("vertices_per_chunk", _verticesPerChunk);
+    conf.get("proxy_levels", _proxyLevels);
+    conf.get("proxy_vertex_budget", _proxyVertexBudget);
+    conf.get("remove_hidden_faces", _removeHiddenFaces);
+    conf.get("max_screen_space_error", _maxScreenSpaceError);
+    conf.get("max_texture_cache_size", _maxTextureCacheSize);
+    conf.get("max_art_cache_size", _maxArtCacheSize);
 }
 
 Config
@@ -109,10 +228,50 @@ CompilerSettings::getConfig() const
             bin.set("lodscale", b->lodScale);
         }
     }
+
+    if (!_sizeBins.empty())
+    {
+        Config sizeBins("size_bins");
+        for(SizeBins::const_iterator b = _sizeBins.begin(); b != _sizeBins.end(); ++b)
+        {
+            Config bin("bin");
+            bin.set("max_size", b->maxSize);
+            bin.set("lod_scale", b->lodScale);
+            sizeBins.add(bin);
+        }
+        conf.set(sizeBins);
+    }
+
+    if (!_textureTiers.empty())
+    {
+        Config textureTiers("texture_tiers");
+        for(TextureTiers::const_iterator t = _textureTiers.begin(); t != _textureTiers.end(); ++t)
+        {
+            Config tier("tier");
+            tier.set("max_level", t->maxLevel);
+            tier.set("max_size", t->maxSize);
+            textureTiers.add(tier);
+        }
+        conf.set(textureTiers);
+    }
     
     conf.set("range_factor", _rangeFactor);
     conf.set("clustering", _useClustering);
     conf.set("max_verts_per_cluster", _maxVertsPerCluster);
+    conf.set("clustering_grid_size", _clusteringGridSize);
+    conf.set("clustering_threads", _clusteringThreads);
+    conf.set("quantize_vertices", _quantizeVertices);
+    conf.set("optimize_vertex_cache", _optimizeVertexCache);
+    conf.set("instance_gable_roofs", _instanceGableRoofs);
+    conf.set("instance_boxes", _instanceBoxes);
+    conf.set("instances_per_cell", _instancesPerCell);
+    conf.set("vertices_per_chunk", _verticesPerChunk);
+    conf.set("proxy_levels", _proxyLevels);
+    conf.set("proxy_vertex_budget", _proxyVertexBudget);
+    conf.set("remove_hidden_faces", _removeHiddenFaces);
+    conf.set("max_screen_space_error", _maxScreenSpaceError);
+    conf.set("max_texture_cache_size", _maxTextureCacheSize);
+    conf.set("max_art_cache_size", _maxArtCacheSize);
 
     return conf;
 }
@@ -432,8 +432,8 @@ Elevation::resolveSkin(BuildContext& bc)
 {
     if ( getSkinSymbol() )
     {
-        SkinResourceVector candidates;
-        bc.getResourceLibrary()->getSkins( getSkinSymbol(), candidates, bc.getDBOptions() );                
+        const SkinResourceVector& candidates = bc.getResourceMemo()->getSkins(
+            bc.getResourceLibrary(), getSkinSymbol(), optional<bool>(), bc.getDBOptions() );
         if ( !candidates.empty() )
         {
             unsigned index = Random(bc.getSeed()).next( candidates.size() );
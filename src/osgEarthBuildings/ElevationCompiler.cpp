@@ -18,7 +18,7 @@
  */
 #include "ElevationCompiler"
 #include <osgEarthFeatures/Session>
-#include <osgUtil/SmoothingVisitor>
+#include <osg/Math>
 
 using namespace osgEarth;
 using namespace osgEarth::Features;
@@ -49,6 +49,14 @@ ElevationCompiler::compile(CompilerOutput&       output,
     // precalculate the frame transformation; combining these will
     // prevent any precision loss during the transform.
     osg::Matrix frame = building->getReferenceFrame() * world2local;
+
+    // Box elevations can be drawn as instances of a unit box instead.
+    // (These are not feature-indexed: every box of a cell shares one draw.)
+    if ( elevation->getRenderAsBox() && output.getCompilerSettings().instanceBoxes() == true )
+    {
+        if ( compileBox(output, elevation, frame, readOptions) )
+            return true;
+    }
         
     SkinResource* skin = elevation->getSkinResource();
     bool useTexture = skin != 0L;
@@ -70,62 +78,27 @@ ElevationCompiler::compile(CompilerOutput&       output,
         texLayer = skin->imageLayer().get();
     }
 
-    bool genColors  = false;
-    bool genNormals = false;
-
-    //TODO
-    Color upperWallColor = elevation->getColor();
-    Color lowerWallColor = elevation->getColor();
-    if ( !skin )
-        lowerWallColor = upperWallColor.brightness(0.95f);
-
-    osg::ref_ptr<osg::Geometry> geom = new osg::Geometry();
-    geom->setUseVertexBufferObjects( true );
-    geom->setUseDisplayList( false );
-
-    if ( stateSet.valid() )
-    {
-        geom->setStateSet( stateSet.get() );
-    }
+    // Write straight into the tile's batch for this tag and skin.
+    GeometryBatch* batch = output.getBatch( elevation->getTag(), stateSet.get() );
 
     // Count the total number of verts.
     unsigned totalNumVerts = 0;
     for(Elevation::Walls::const_iterator wall = walls.begin(); wall != walls.end(); ++wall)
     {
-        totalNumVerts += (6 * wall->getNumPoints());
+        totalNumVerts += (4 * wall->faces.size());
     }
 
     totalNumVerts *= elevation->getNumFloors();
     OE_DEBUG << LC << "Extrusion: total verts in elevation = " << totalNumVerts << "\n";
 
-    // preallocate all attribute arrays.
-    osg::Vec3Array* verts = new osg::Vec3Array();
-    geom->setVertexArray( verts );
+    // Walls are not vertex-colored (yet); the shader modulates with white.
+    const osg::Vec4f white(1,1,1,1);
 
-    osg::Vec4Array* colors = 0L;
-    if ( genColors )
-    {
-        colors = new osg::Vec4Array();
-        geom->setColorArray( colors );
-        geom->setColorBinding( geom->BIND_PER_VERTEX );
-    }
-
-    osg::Vec3Array* texCoords = 0L;
-    if ( skin )
-    {
-        texCoords = new osg::Vec3Array();
-        geom->setTexCoordArray( 0, texCoords );
-    }
+    // Threshold for smoothing normals across neighboring faces (15 degrees)
+    const float smoothDot = cosf(osg::DegreesToRadians(15.0f));
 
-    osg::Vec3Array* normals = 0L;
-    if ( genNormals )
-    {
-        normals = new osg::Vec3Array();
-        geom->setNormalArray( normals );
-        geom->setNormalBinding( geom->BIND_PER_VERTEX );
-    }
+    unsigned vertPtr = batch->begin( totalNumVerts, output.getCurrentFeature() );
 
-    unsigned vertPtr = 0;
     //TODO
     float  floorHeight = elevation->getHeight() / (float)elevation->getNumFloors();
 
@@ -135,66 +108,59 @@ ElevationCompiler::compile(CompilerOutput&       output,
     // zero or more inner walls (where there were holes in the original footprint).
     for(Elevation::Walls::const_iterator wall = walls.begin(); wall != walls.end(); ++wall)
     {
-        osg::DrawElements* de = 
-            totalNumVerts > 0xFFFF ? (osg::DrawElements*) new osg::DrawElementsUInt  ( GL_TRIANGLES ) :
-            totalNumVerts > 0xFF   ? (osg::DrawElements*) new osg::DrawElementsUShort( GL_TRIANGLES ) :
-                                     (osg::DrawElements*) new osg::DrawElementsUByte ( GL_TRIANGLES );
-
-        // pre-allocate for speed
-        //de->reserveElements( numWallVerts );
-        geom->addPrimitiveSet( de );
+        const Elevation::Faces& faces = wall->faces;
+        unsigned numFaces = faces.size();
+        if ( numFaces == 0 )
+            continue;
+
+        // Calculate the face normals up front. Each corner normal is the face normal,
+        // smoothed with the neighboring face's normal if they are nearly coplanar.
+        // (This replaces a SmoothingVisitor pass on a separate geometry.)
+        std::vector<osg::Vec3f> faceNormals( numFaces );
+        for(unsigned i=0; i<numFaces; ++i)
+        {
+            const Elevation::Face& f = faces[i];
+            osg::Vec3d n = (f.left.lower - f.left.upper) ^ (f.right.lower - f.left.upper);
+            n = osg::Matrix::transform3x3( n, frame );
+            n.normalize();
+            faceNormals[i] = n;
+        }
 
         OE_DEBUG << LC << "..elevation has " << elevation->getNumFloors() << " floors\n";
 
-        float numFloorsF = (float)elevation->getNumFloors();
-            
         for(unsigned flr=0; flr < elevation->getNumFloors(); ++flr)
         {
             float lowerZ = (float)flr * floorHeight;
     
-            OE_DEBUG << LC << "...wall has " << wall->faces.size() << " faces\n";
-            for(Elevation::Faces::const_iterator f = wall->faces.begin(); f != wall->faces.end(); ++f, vertPtr += 4)
+            OE_DEBUG << LC << "...wall has " << faces.size() << " faces\n";
+            for(unsigned i=0; i<numFaces; ++i)
             {
-                osg::Vec3d Lvec = f->left.upper - f->left.lower; Lvec.normalize();
-                osg::Vec3d Rvec = f->right.upper - f->right.lower; Rvec.normalize();
+                const Elevation::Face* f = &faces[i];
 
                 float upperZ = lowerZ + floorHeight;
 
+                // skip floors that something else covers (see HiddenFaceRemover)
+                if ( upperZ <= f->hiddenHeight + 0.01f )
+                    continue;
+
+                osg::Vec3d Lvec = f->left.upper - f->left.lower; Lvec.normalize();
+                osg::Vec3d Rvec = f->right.upper - f->right.lower; Rvec.normalize();
+
                 osg::Vec3d LL = (f->left.lower  + Lvec*lowerZ) * frame;
                 osg::Vec3d UL = (f->left.lower  + Lvec*upperZ) * frame;
                 osg::Vec3d LR = (f->right.lower + Rvec*lowerZ) * frame;
                 osg::Vec3d UR = (f->right.lower + Rvec*upperZ) * frame;
 
-                verts->push_back( UL );
-                verts->push_back( LL );
-                verts->push_back( LR );
-                verts->push_back( UR );
-           
-#if 0
-                if ( anchors )
-                {
-                    float x = structure.baseCentroid.x(), y = structure.baseCentroid.y(), vo = structure.verticalOffset;
-
-                    (*anchors)[vertPtr+1].set( x, y, vo, Clamping::ClampToGround );
-                    (*anchors)[vertPtr+2].set( x, y, vo, Clamping::ClampToGround );
-                    (*anchors)[vertPtr+3].set( x, y, vo, Clamping::ClampToGround );
+                const osg::Vec3f& n     = faceNormals[i];
+                const osg::Vec3f& nPrev = faceNormals[(i+numFaces-1) % numFaces];
+                const osg::Vec3f& nNext = faceNormals[(i+1) % numFaces];
 
-                    (*anchors)[vertPtr+0].set( x, y, vo, Clamping::ClampToAnchor );
-                    (*anchors)[vertPtr+4].set( x, y, vo, Clamping::ClampToAnchor );
-                    (*anchors)[vertPtr+5].set( x, y, vo, Clamping::ClampToAnchor );
-                }
-#endif
+                osg::Vec3f nL = n, nR = n;
+                if ( numFaces > 1 && n * nPrev >= smoothDot ) { nL = n + nPrev; nL.normalize(); }
+                if ( numFaces > 1 && n * nNext >= smoothDot ) { nR = n + nNext; nR.normalize(); }
 
-                // Assign wall polygon colors.
-                if ( colors )
-                {
-                    colors->push_back( upperWallColor );
-                    colors->push_back( lowerWallColor );
-                    colors->push_back( lowerWallColor );
-                    colors->push_back( upperWallColor );
-                }
-
-                if ( texCoords )
+                osg::Vec3f texUL3, texLL3, texLR3, texUR3;
+                if ( useTexture )
                 {
                     // Calculate the texture coordinates at each corner. The structure builder
                     // will have spaced the verts correctly for this to work.
@@ -215,20 +181,23 @@ ElevationCompiler::compile(CompilerOutput&       output,
                     texUR = texBias + osg::componentMultiply(texUR, texScale);
                     texLL = texBias + osg::componentMultiply(texLL, texScale);
                     texLR = texBias + osg::componentMultiply(texLR, texScale);
-                        
-                    texCoords->push_back( osg::Vec3f(texUL.x(), texUL.y(), texLayer) );
-                    texCoords->push_back( osg::Vec3f(texLL.x(), texLL.y(), texLayer) );
-                    texCoords->push_back( osg::Vec3f(texLR.x(), texLR.y(), texLayer) );
-                    texCoords->push_back( osg::Vec3f(texUR.x(), texUR.y(), texLayer) );
+
+                    texUL3.set(texUL.x(), texUL.y(), texLayer);
+                    texLL3.set(texLL.x(), texLL.y(), texLayer);
+                    texLR3.set(texLR.x(), texLR.y(), texLayer);
+                    texUR3.set(texUR.x(), texUR.y(), texLayer);
                 }
 
+                batch->addVertex( UL, nL, white, texUL3 );
+                batch->addVertex( LL, nL, white, texLL3 );
+                batch->addVertex( LR, nR, white, texLR3 );
+                batch->addVertex( UR, nR, white, texUR3 );
+
                 // build the triangles.
-                de->addElement( vertPtr+0 );
-                de->addElement( vertPtr+1 );
-                de->addElement( vertPtr+2 );
-                de->addElement( vertPtr+0 );
-                de->addElement( vertPtr+2 );
-                de->addElement( vertPtr+3 );
+                batch->addTriangle( vertPtr+0, vertPtr+1, vertPtr+2 );
+                batch->addTriangle( vertPtr+0, vertPtr+2, vertPtr+3 );
+
+                vertPtr += 4;
 
             } // faces loop
 
@@ -236,18 +205,58 @@ ElevationCompiler::compile(CompilerOutput&       output,
 
     } // walls loop
 
-    // TODO - temporary, doesn't smooth disconnected edges
-    osgUtil::SmoothingVisitor::smooth( *geom.get(), 15.0f );
-    
-    if ( !genColors )
+    batch->end();
+
+    return true;
+}
+
+bool
+ElevationCompiler::compileBox(CompilerOutput&       output,
+                              const Elevation*      elevation,
+                              const osg::Matrix&    frame,
+                              const osgDB::Options* readOptions) const
+{
+    const Elevation::Walls& walls = elevation->getWalls();
+    if ( walls.size() != 1 || walls.front().faces.empty() )
+        return false;
+
+    // The AABB is in the elevation's rotated space, just like the box footprint.
+    const osg::BoundingBox& aabb = elevation->getAxisAlignedBoundingBox();
+    const Elevation::Face& face = walls.front().faces.front();
+
+    float width  = aabb.xMax() - aabb.xMin();
+    float depth  = aabb.yMax() - aabb.yMin();
+    float lowerZ = face.left.lower.z();
+    float height = face.left.upper.z() - lowerZ;
+
+    if ( width <= 0.0f || depth <= 0.0f || height <= 0.0f )
+        return false;
+
+    // maps the unit cube onto the box:
+    osg::Matrix matrix =
+        osg::Matrix::scale( width, depth, height ) *
+        osg::Matrix::translate( aabb.xMin(), aabb.yMin(), lowerZ ) *
+        elevation->getRotation() *
+        frame;
+
+    // Skins repeat horizontally every image width and once per floor,
+    // as they do on compiled walls.
+    osg::Texture* texture = 0L;
+    osg::Vec3f texRepeat(0.0f, 0.0f, 0.0f);
+    osg::Vec4f texRect(0.0f, 0.0f, 1.0f, 1.0f);
+    float texLayer = 0.0f;
+
+    SkinResource* skin = elevation->getSkinResource();
+    if ( skin )
     {
-        colors = new osg::Vec4Array();
-        geom->setColorArray( colors );
-        geom->setColorBinding( geom->BIND_OVERALL );
-        colors->push_back(osg::Vec4(1,1,1,1));
+        texture = output.getTexture( skin, readOptions );
+
+        float texWidth = skin->imageWidth().get();
+        texRepeat.set( width / texWidth, depth / texWidth, elevation->getNumFloors() );
+        texRect.set( skin->imageBiasS().get(), skin->imageBiasT().get(), skin->imageScaleS().get(), skin->imageScaleT().get() );
+        texLayer = skin->imageLayer().get();
     }
-    
-    output.addDrawable( geom.get(), elevation->getTag() );
 
+    output.getBoxInstancer( elevation->getTag() )->addBox( texture, matrix, texRepeat, texLayer, texRect );
     return true;
 }
@@ -17,6 +17,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>
  */
 #include "FlatRoofCompiler"
+#include "RoofTessellator"
 #include <osgEarth/Tessellator>
 #include <osgEarth/Random>
 #include <osgEarthFeatures/Session>
@@ -26,6 +27,7 @@
 #include <osg/ComputeBoundsVisitor>
 #include <osg/Program>
 #include <osg/LineWidth>
+#include <osg/TriangleIndexFunctor>
 
 using namespace osgEarth;
 using namespace osgEarth::Features;
@@ -38,6 +40,70 @@ namespace
 {
     static bool s_debug = ::getenv("OSGEARTH_BUILDINGS_DEBUG") != 0L;
 
+    // Collects the triangle indices of a tessellated geometry.
+    struct CollectTriangles
+    {
+        std::vector<unsigned>* _indices;
+        void operator()(unsigned i0, unsigned i1, unsigned i2)
+        {
+            _indices->push_back(i0);
+            _indices->push_back(i1);
+            _indices->push_back(i2);
+        }
+    };
+
+    // General-purpose tessellation for roof outlines that the RoofTessellator
+    // rejects. Builds a line-loop geometry from its input and returns it
+    // triangulated, with the triangle indices in "indices".
+    osg::Geometry* tessellateFallback(const RoofTessellator& input, bool textured, std::vector<unsigned>& indices)
+    {
+        osg::Geometry* geom = new osg::Geometry();
+        geom->setUseVertexBufferObjects( false );
+        geom->setUseDisplayList( false );
+
+        const std::vector<osg::Vec3f>& v = input.getVertices();
+        osg::Vec3Array* verts = new osg::Vec3Array( v.begin(), v.end() );
+        geom->setVertexArray( verts );
+
+        if ( textured )
+        {
+            const std::vector<osg::Vec3f>& t = input.getTexCoords();
+            geom->setTexCoordArray( 0, new osg::Vec3Array(t.begin(), t.end()) );
+        }
+
+        osg::Vec3Array* normals = new osg::Vec3Array();
+        normals->assign( verts->size(), osg::Vec3(0,0,1) );
+        geom->setNormalArray( normals );
+        geom->setNormalBinding( osg::Geometry::BIND_PER_VERTEX );
+
+        unsigned start = 0u;
+        const std::vector<unsigned>& rings = input.getRingSizes();
+        for(unsigned r=0; r<rings.size(); ++r)
+        {
+            geom->addPrimitiveSet( new osg::DrawArrays(GL_LINE_LOOP, start, rings[r]) );
+            start += rings[r];
+        }
+
+        osgEarth::Tessellator oeTess;
+        if (!oeTess.tessellateGeometry(*geom))
+        {
+            //fallback to osg tessellator
+            OE_DEBUG << LC << "Falling back on OSG tessellator (" << geom->getName() << ")" << std::endl;
+
+            osgUtil::Tessellator tess;
+            tess.setTessellationType( osgUtil::Tessellator::TESS_TYPE_GEOMETRY );
+            tess.setWindingType( osgUtil::Tessellator::TESS_WINDING_ODD );
+            tess.retessellatePolygons( *geom );
+            MeshConsolidator::convertToTriangles( *geom );
+        }
+
+        osg::TriangleIndexFunctor<CollectTriangles> triangles;
+        triangles._indices = &indices;
+        geom->accept( triangles );
+
+        return geom;
+    }
+
     osg::Node* createModelBoxGeom(const osg::Vec3d* box, const osg::Matrix& frame, float z)
     {
         osg::Vec3Array* v = new osg::Vec3Array();
@@ -92,8 +158,6 @@ FlatRoofCompiler::compile(CompilerOutput&       output,
     // prevent any precision loss during the transform.
     osg::Matrix frame = building->getReferenceFrame() * world2local;
 
-    bool genColors = true; //false;   // TODO
-
     // find a texture:
     SkinResource* skin = roof->getSkinResource();
     osg::ref_ptr<osg::StateSet> stateSet;
@@ -102,30 +166,6 @@ FlatRoofCompiler::compile(CompilerOutput&       output,
         stateSet = output.getSkinStateSet(skin, readOptions);
     }
 
-    // Build a flat roof.
-    osg::ref_ptr<osg::Geometry> geom = new osg::Geometry();
-    geom->setUseVertexBufferObjects( true );
-    geom->setUseDisplayList( false );
-
-    osg::Vec3Array* verts = new osg::Vec3Array();
-    geom->setVertexArray( verts );
-
-    osg::Vec4Array* colors = 0L;
-    if ( genColors )
-    {
-        colors = new osg::Vec4Array();
-        geom->setColorArray( colors );
-        geom->setColorBinding( geom->BIND_PER_VERTEX );
-    }
-
-    osg::Vec3Array* texCoords = 0L;
-    if ( stateSet.valid() )
-    {
-        texCoords = new osg::Vec3Array();
-        geom->setTexCoordArray( 0, texCoords );
-        geom->setStateSet( stateSet.get() );
-    }
-
     // prep texture scale/bias for atlas support
     osg::Vec3f texBias(0, 0, 0);
     osg::Vec3f texScale(1, 1, 1);
@@ -135,25 +175,17 @@ FlatRoofCompiler::compile(CompilerOutput&       output,
         texScale.set( skin->imageScaleS().get(), skin->imageScaleT().get(), 1.0f );
     }
 
-    //osg::Vec4Array* anchors = 0L;
-    //if ( _gpuClamping )
-    //{
-    //    // fake out the OSG tessellator. It does not preserve attrib arrays in the Tessellator.
-    //    // so we will put them in one of the texture arrays and copy them to an attrib array 
-    //    // after tessellation. #osghack
-    //    anchors = new osg::Vec4Array();
-    //    roof->setTexCoordArray(1, anchors);
-    //}
-
     float roofZ = 0.0f;
 
-    // Create a series of line loops that the tessellator can reorganize into polygons.
-    unsigned vertptr = 0;
+    // Collect the roof outline (outer wall first, then any holes) into the
+    // tile's tessellator.
+    RoofTessellator& tess = output.getRoofTessellator();
+    tess.begin();
+
     for(Elevation::Walls::const_iterator wall = elevation->getWalls().begin();
         wall != elevation->getWalls().end();
         ++wall)
     {
-        unsigned elevptr = vertptr;
         for(Elevation::Faces::const_iterator f = wall->faces.begin(); f != wall->faces.end(); ++f)
         {
             // Only use source verts; we skip interim verts inserted by the 
@@ -161,84 +193,60 @@ FlatRoofCompiler::compile(CompilerOutput&       output,
             // need them for the roof line.
             if ( f->left.isFromSource )
             {
-                verts->push_back( f->left.upper );
                 roofZ = f->left.upper.z();
 
-                if ( colors )
-                {
-                    colors->push_back( roof->getColor() );
-                }
-
-                if ( texCoords )
-                {
-                    osg::Vec3f tc( f->left.roofUV.x(), f->left.roofUV.y(), (float)0.0f );
-                    texCoords->push_back( texBias + osg::componentMultiply(tc, texScale) );
-                }
-
-#if 0
-                if ( anchors )
-                {
-                    float 
-                        x = structure.baseCentroid.x(),
-                        y = structure.baseCentroid.y(), 
-                        vo = structure.verticalOffset;
-
-                    if ( flatten )
-                    {
-                        anchors->push_back( osg::Vec4f(x, y, vo, Clamping::ClampToAnchor) );
-                    }
-                    else
-                    {
-                        anchors->push_back( osg::Vec4f(x, y, vo + f->left.height, Clamping::ClampToGround) );
-                    }
-                }
-#endif
-
-                ++vertptr;
+                osg::Vec3f tc( f->left.roofUV.x(), f->left.roofUV.y(), (float)0.0f );
+                tess.addVertex( f->left.upper, texBias + osg::componentMultiply(tc, texScale) );
             }
         }
-        geom->addPrimitiveSet( new osg::DrawArrays(GL_LINE_LOOP, elevptr, vertptr-elevptr) );
-    } 
+        tess.endRing();
+    }
 
-    osg::Vec3Array* normal = new osg::Vec3Array(verts->size());
-    geom->setNormalArray( normal );
-    geom->setNormalBinding( osg::Geometry::BIND_PER_VERTEX );
-    normal->assign( verts->size(), osg::Vec3(0,0,1) );
-    
-    // Tessellate the roof lines into polygons.
-    osgEarth::Tessellator oeTess;
-    if (!oeTess.tessellateGeometry(*geom))
+    // Tessellate the roof lines into triangles. Only degenerate outlines
+    // need the general-purpose tessellators.
+    const std::vector<osg::Vec3f>* verts     = &tess.getVertices();
+    const std::vector<osg::Vec3f>* texCoords = &tess.getTexCoords();
+    const std::vector<unsigned>*   indices   = &tess.getTriangles();
+
+    osg::ref_ptr<osg::Geometry> geom;
+    std::vector<unsigned> fallbackIndices;
+
+    if ( tess.tessellate() == RoofTessellator::PATH_FALLBACK )
     {
-        //fallback to osg tessellator
-        OE_DEBUG << LC << "Falling back on OSG tessellator (" << geom->getName() << ")" << std::endl;
-
-        osgUtil::Tessellator tess;
-        tess.setTessellationType( osgUtil::Tessellator::TESS_TYPE_GEOMETRY );
-        tess.setWindingType( osgUtil::Tessellator::TESS_WINDING_ODD );
-        tess.retessellatePolygons( *geom );
-        MeshConsolidator::convertToTriangles( *geom );
+        geom = tessellateFallback( tess, stateSet.valid(), fallbackIndices );
+
+        // the tessellator may have added vertices, so use its arrays:
+        verts   = &static_cast<osg::Vec3Array*>(geom->getVertexArray())->asVector();
+        indices = &fallbackIndices;
+        osg::Vec3Array* tc = dynamic_cast<osg::Vec3Array*>(geom->getTexCoordArray(0));
+        texCoords = tc ? &tc->asVector() : 0L;
     }
 
-#if 0
-    // Move the anchors to the correct place. :)
-    if ( _gpuClamping )
+    // Copy the roof into the batch, transforming into the final frame.
+    if ( !indices->empty() )
     {
-        osg::Vec4Array* a = static_cast<osg::Vec4Array*>(roof->getTexCoordArray(1));
-        if ( a )
+        osg::Vec3f up = osg::Matrix::transform3x3( osg::Vec3f(0,0,1), frame );
+        up.normalize();
+
+        GeometryBatch* batch = output.getBatch( roof->getTag(), stateSet.get() );
+        unsigned start = batch->begin( verts->size(), output.getCurrentFeature() );
+
+        for(unsigned i=0; i<verts->size(); ++i)
         {
-            roof->setVertexAttribArray    ( Clamping::AnchorAttrLocation, a );
-            roof->setVertexAttribBinding  ( Clamping::AnchorAttrLocation, osg::Geometry::BIND_PER_VERTEX );
-            roof->setVertexAttribNormalize( Clamping::AnchorAttrLocation, false );
-            roof->setTexCoordArray(1, 0L);
+            batch->addVertex(
+                (*verts)[i] * frame,
+                up,
+                roof->getColor(),
+                texCoords && i < texCoords->size() ? (*texCoords)[i] : osg::Vec3f() );
         }
-    }
-#endif
 
-    // Transform into the final frame:
-    for(osg::Vec3Array::iterator v = verts->begin(); v != verts->end(); ++v)
-        (*v) = (*v) * frame;
+        for(unsigned i=0; i+2<indices->size(); i+=3)
+        {
+            batch->addTriangle( start+(*indices)[i], start+(*indices)[i+1], start+(*indices)[i+2] );
+        }
 
-    output.addDrawable( geom.get(), roof->getTag() );
+        batch->end();
+    }
     
     // Load models:
     ModelResource* model = roof->getModelResource();
@@ -0,0 +1,314 @@
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "FootprintSimplifier"
+#include <osg/Math>
+#include <cmath>
+
+using namespace osgEarth;
+using namespace osgEarth::Symbology;
+using namespace osgEarth::Buildings;
+
+#define LC "[FootprintSimplifier] "
+
+namespace
+{
+    inline double cross2d(const osg::Vec3d& a, const osg::Vec3d& b)
+    {
+        return a.x()*b.y() - a.y()*b.x();
+    }
+
+    // Distance in XY from p to the segment ab.
+    double distanceToSegment(const osg::Vec3d& p, const osg::Vec3d& a, const osg::Vec3d& b)
+    {
+        osg::Vec3d ab(b.x()-a.x(), b.y()-a.y(), 0.0);
+        osg::Vec3d ap(p.x()-a.x(), p.y()-a.y(), 0.0);
+        double len2 = ab.length2();
+        double t = len2 > 0.0 ? osg::clampBetween((ap*ab)/len2, 0.0, 1.0) : 0.0;
+        return (ap - ab*t).length();
+    }
+
+    double signedArea(const std::vector<osg::Vec3d>& ring)
+    {
+        double area = 0.0;
+        for(unsigned i=0; i<ring.size(); ++i)
+            area += cross2d(ring[i], ring[(i+1)%ring.size()]);
+        return 0.5*area;
+    }
+
+    // True if segments ab and cd cross at a point interior to both.
+    bool properlyIntersect(const osg::Vec3d& a, const osg::Vec3d& b, const osg::Vec3d& c, const osg::Vec3d& d)
+    {
+        double d1 = cross2d(b-a, c-a), d2 = cross2d(b-a, d-a);
+        double d3 = cross2d(d-c, a-c), d4 = cross2d(d-c, b-c);
+        return ((d1 > 0.0 && d2 < 0.0) || (d1 < 0.0 && d2 > 0.0)) &&
+               ((d3 > 0.0 && d4 < 0.0) || (d3 < 0.0 && d4 > 0.0));
+    }
+}
+
+FootprintSimplifier::FootprintSimplifier(float tolerance, float squareAngle) :
+_tolerance   ( tolerance ),
+_squareAngle ( squareAngle ),
+_numPointsIn ( 0u ),
+_numPointsOut( 0u )
+{
+    //nop
+}
+
+void
+FootprintSimplifier::douglasPeucker(const Points& in, double tolerance, Points& out) const
+{
+    unsigned n = in.size();
+    if ( n <= 3u )
+    {
+        out = in;
+        return;
+    }
+
+    // Split the closed ring at the point farthest from the first one,
+    // and simplify each half as an open polyline.
+    unsigned split = 0u;
+    double splitDist2 = 0.0;
+    for(unsigned i=1; i<n; ++i)
+    {
+        double d2 = (in[i]-in[0]).length2();
+        if ( d2 > splitDist2 )
+            split = i, splitDist2 = d2;
+    }
+
+    std::vector<bool> keep( n, false );
+    keep[0] = keep[split] = true;
+
+    // Index n stands for point 0, closing the ring.
+    std::vector< std::pair<unsigned, unsigned> > stack;
+    stack.push_back( std::make_pair(0u, split) );
+    stack.push_back( std::make_pair(split, n) );
+
+    while( !stack.empty() )
+    {
+        unsigned a = stack.back().first, b = stack.back().second;
+        stack.pop_back();
+        if ( b - a < 2u )
+            continue;
+
+        unsigned worst = a;
+        double worstDist = 0.0;
+        for(unsigned i=a+1; i<b; ++i)
+        {
+            double d = distanceToSegment( in[i], in[a], in[b%n] );
+            if ( d > worstDist )
+                worst = i, worstDist = d;
+        }
+
+        if ( worstDist > tolerance )
+        {
+            keep[worst] = true;
+            stack.push_back( std::make_pair(a, worst) );
+            stack.push_back( std::make_pair(worst, b) );
+        }
+    }
+
+    out.clear();
+    for(unsigned i=0; i<n; ++i)
+        if ( keep[i] )
+            out.push_back( in[i] );
+}
+
+void
+FootprintSimplifier::square(Rings& rings, double tolerance) const
+{
+    if ( rings.empty() || rings.front().size() < 3u )
+        return;
+
+    // The main axis follows the longest edge of the outer ring.
+    const Points& outer = rings.front();
+    double theta = 0.0, longest = 0.0;
+    for(unsigned i=0; i<outer.size(); ++i)
+    {
+        osg::Vec3d e = outer[(i+1)%outer.size()] - outer[i];
+        double len2 = e.x()*e.x() + e.y()*e.y();
+        if ( len2 > longest )
+            longest = len2, theta = atan2(e.y(), e.x());
+    }
+
+    const double quarter = 0.5*osg::PI;
+    const double maxAngle = osg::DegreesToRadians( (double)_squareAngle );
+
+    for(Rings::iterator ring = rings.begin(); ring != rings.end(); ++ring)
+    {
+        Points& pts = *ring;
+        unsigned m = pts.size();
+        if ( m < 3u )
+            continue;
+
+        // Each edge becomes a line; edges close to the axes are rotated onto them
+        // about their midpoints.
+        std::vector<osg::Vec3d> origins( m ), dirs( m );
+        for(unsigned i=0; i<m; ++i)
+        {
+            const osg::Vec3d& p = pts[i];
+            const osg::Vec3d& q = pts[(i+1)%m];
+            double phi = atan2( q.y()-p.y(), q.x()-p.x() );
+            double k = floor( (phi-theta)/quarter + 0.5 );
+            double diff = (phi-theta) - k*quarter;
+
+            if ( fabs(diff) <= maxAngle )
+            {
+                double snapped = theta + k*quarter;
+                origins[i] = (p+q)*0.5;
+                dirs[i].set( cos(snapped), sin(snapped), 0.0 );
+            }
+            else
+            {
+                origins[i] = p;
+                dirs[i] = q - p;
+                dirs[i].z() = 0.0;
+                dirs[i].normalize();
+            }
+        }
+
+        // Each corner moves to where its two edge lines meet, unless they are
+        // parallel or the move would exceed the tolerance.
+        Points result( pts );
+        for(unsigned i=0; i<m; ++i)
+        {
+            unsigned prev = (i+m-1)%m;
+            double denom = cross2d( dirs[prev], dirs[i] );
+            if ( fabs(denom) < 1e-6 )
+                continue;
+
+            double t = cross2d( origins[i]-origins[prev], dirs[i] ) / denom;
+            osg::Vec3d corner = origins[prev] + dirs[prev]*t;
+            corner.z() = pts[i].z();
+
+            if ( (corner - pts[i]).length() <= tolerance )
+                result[i] = corner;
+        }
+        pts.swap( result );
+    }
+}
+
+bool
+FootprintSimplifier::isValid(const Rings& rings, const Rings& original) const
+{
+    for(unsigned r=0; r<rings.size(); ++r)
+    {
+        if ( rings[r].size() < 3u )
+            return false;
+
+        // rings must keep their orientation:
+        double before = signedArea( original[r] );
+        double after  = signedArea( rings[r] );
+        if ( after == 0.0 || (before > 0.0) != (after > 0.0) )
+            return false;
+    }
+
+    // no two edges may cross, within a ring or between rings.
+    for(unsigned r1=0; r1<rings.size(); ++r1)
+    {
+        const Points& ring1 = rings[r1];
+        for(unsigned i=0; i<ring1.size(); ++i)
+        {
+            const osg::Vec3d& a = ring1[i];
+            const osg::Vec3d& b = ring1[(i+1)%ring1.size()];
+
+            for(unsigned r2=r1; r2<rings.size(); ++r2)
+            {
+                const Points& ring2 = rings[r2];
+                for(unsigned j = (r2==r1 ? i+1 : 0); j<ring2.size(); ++j)
+                {
+                    if ( properlyIntersect(a, b, ring2[j], ring2[(j+1)%ring2.size()]) )
+                        return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+bool
+FootprintSimplifier::simplify(Polygon* footprint)
+{
+    if ( !footprint || footprint->size() < 3u )
+        return false;
+
+    Rings original;
+    original.push_back( Points(footprint->begin(), footprint->end()) );
+    for(RingCollection::const_iterator h = footprint->getHoles().begin(); h != footprint->getHoles().end(); ++h)
+        original.push_back( Points((*h)->begin(), (*h)->end()) );
+
+    unsigned numIn = 0u;
+    for(unsigned r=0; r<original.size(); ++r)
+        numIn += original[r].size();
+
+    _numPointsIn += numIn;
+
+    // Squaring moves the corners that Douglas-Peucker keeps, which moves the
+    // edges the dropped points lie near by as much; so the two share the
+    // tolerance to keep every original point within it.
+    bool squaring = _squareAngle > 0.0f;
+
+    // If the result breaks the footprint, back off the tolerance and try again.
+    double tolerance = _tolerance;
+    for(unsigned attempt=0; attempt<4u; ++attempt, tolerance *= 0.5)
+    {
+        double budget = squaring ? 0.5*tolerance : tolerance;
+
+        Rings rings, sources;
+        for(unsigned r=0; r<original.size(); ++r)
+        {
+            Points pts;
+            douglasPeucker( original[r], budget, pts );
+
+            // holes that collapse are dropped; the outer ring may not collapse.
+            if ( pts.size() < 3u && r > 0u )
+                continue;
+
+            rings.push_back( pts );
+            sources.push_back( original[r] );
+        }
+
+        if ( squaring )
+            square( rings, budget );
+
+        if ( !isValid(rings, sources) )
+            continue;
+
+        footprint->clear();
+        footprint->insert( footprint->end(), rings.front().begin(), rings.front().end() );
+
+        RingCollection holes;
+        for(unsigned r=1; r<rings.size(); ++r)
+        {
+            Ring* hole = new Ring();
+            hole->insert( hole->end(), rings[r].begin(), rings[r].end() );
+            holes.push_back( hole );
+        }
+        footprint->getHoles().swap( holes );
+
+        unsigned numOut = 0u;
+        for(unsigned r=0; r<rings.size(); ++r)
+            numOut += rings[r].size();
+
+        _numPointsOut += numOut;
+        return true;
+    }
+
+    _numPointsOut += numIn;
+    return false;
+}
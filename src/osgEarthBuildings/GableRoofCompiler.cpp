@@ -17,7 +17,12 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>
  */
 #include "GableRoofCompiler"
+#include "BuildingShaders"
 #include <osgEarthFeatures/Session>
+#include <osgEarth/VirtualProgram>
+#include <osgEarth/StringUtils>
+#include <cmath>
+#include <climits>
 
 using namespace osgEarth;
 using namespace osgEarth::Features;
@@ -26,6 +31,57 @@ using namespace osgEarth::Buildings;
 
 #define LC "[GableRoofCompiler] "
 
+namespace
+{
+    // texture repeats per octave that instanced roofs distinguish
+    const float REPEAT_BUCKETS_PER_OCTAVE = 8.0f;
+
+    int repeatToBucket(float repeat)
+    {
+        return repeat > 0.0f ? (int)floor(log(repeat)/log(2.0f) * REPEAT_BUCKETS_PER_OCTAVE + 0.5f) : INT_MIN;
+    }
+
+    float bucketToRepeat(int bucket)
+    {
+        return bucket == INT_MIN ? 0.0f : pow(2.0f, (float)bucket / REPEAT_BUCKETS_PER_OCTAVE);
+    }
+
+    /**
+     * Model resource that materializes the gable roof template
+     * instead of loading a model from a URI.
+     */
+    class GableRoofModel : public ModelResource
+    {
+    public:
+        GableRoofModel(osg::Geometry* geom, const std::string& name, const std::string& key) :
+            _geom( geom )
+        {
+            // the config (and therefore the resource cache key) must be unique:
+            this->name() = name;
+            this->uri() = URI( Stringify() << "oeb_gable_roof." << key );
+        }
+
+    protected:
+        osg::Node* createNodeFromURI(const URI& uri, const osgDB::Options* dbOptions) const
+        {
+            osg::Geode* geode = new osg::Geode();
+            geode->addDrawable( _geom.get() );
+
+            // instance transforms scale non-uniformly, so derive the normals
+            // from the final faces instead.
+            VirtualProgram* vp = VirtualProgram::getOrCreate( geode->getOrCreateStateSet() );
+            vp->setName( "Buildings gable roof" );
+            BuildingShaders shaders;
+            shaders.load( vp, shaders.FlatNormalsVertex );
+            shaders.load( vp, shaders.FlatNormalsFragment );
+
+            return geode;
+        }
+
+        osg::ref_ptr<osg::Geometry> _geom;
+    };
+}
+
 GableRoofCompiler::GableRoofCompiler(Session* session) :
 _session( session )
 {
@@ -92,35 +148,7 @@ GableRoofCompiler::compile(CompilerOutput&       output,
     // prevent any precision loss during the transform.
     osg::Matrix frame = building->getReferenceFrame() * world2local;
     
-    // find a texture:
     SkinResource* skin = roof->getSkinResource();
-    osg::ref_ptr<osg::StateSet> stateSet;
-    if ( skin )
-    {
-        stateSet = output.getSkinStateSet(skin, readOptions);
-    }
-
-    osg::ref_ptr<osg::Geometry> geom = new osg::Geometry();
-    geom->setUseVertexBufferObjects( true );
-    geom->setUseDisplayList( false );
-
-    // copy the unit-space template:
-    osg::Vec3Array* verts = new osg::Vec3Array(_verts->begin(), _verts->end());
-    geom->setVertexArray( verts );
-    
-    osg::Vec3Array* texCoords = 0L;
-    if ( stateSet.valid() )
-    {
-        // copy the texture coordinates (though this may not be strictly necessary)
-        texCoords = new osg::Vec3Array(_texCoords->begin(), _texCoords->end());
-        geom->setTexCoordArray( 0, texCoords );
-        geom->setStateSet( stateSet.get() );
-    }
-
-    osg::Vec3Array* normals = new osg::Vec3Array();
-    normals->reserve( verts->size() );
-    geom->setNormalArray( normals );
-    geom->setNormalBinding( geom->BIND_PER_VERTEX );
 
     // highest point (this data is guaranteed to exist)
     float roofZ = elevation->getUppermostZ();
@@ -131,33 +159,168 @@ GableRoofCompiler::compile(CompilerOutput&       output,
     osg::Vec3f scale(aabb.xMax()-aabb.xMin(), aabb.yMax()-aabb.yMin(), 1.0f);
     osg::Vec3f bias (aabb.xMin(), aabb.yMin(), roofZ);
 
+    // In instancing mode the template goes through the same scale, bias,
+    // rotation and frame as below, but as a transform on a shared mesh.
+    if ( output.getCompilerSettings().instanceGableRoofs() == true )
+    {
+        ModelResource* model = getOrCreateInstanceModel( output, skin, osg::Vec2f(scale.x(), scale.y()), readOptions );
+        if ( model )
+        {
+            osg::Matrix placement =
+                osg::Matrix::scale( scale ) *
+                osg::Matrix::translate( bias ) *
+                elevation->getRotation() *
+                frame;
+
+            output.addInstance( model, placement, roof->getTag() );
+            return true;
+        }
+    }
+
+    // find a texture:
+    osg::ref_ptr<osg::StateSet> stateSet;
+    if ( skin )
+    {
+        stateSet = output.getSkinStateSet(skin, readOptions);
+    }
+
     osg::Vec2f tscale(1.0f, 1.0f);
     if ( skin )
         tscale.set(scale.x() / skin->imageWidth().get(), scale.y() / skin->imageHeight().get());
 
+    // prep texture scale/bias for atlas support
+    osg::Vec3f texBias(0, 0, 0);
+    osg::Vec3f texScale(1, 1, 1);
+    if ( skin )
+    {
+        texBias.set ( skin->imageBiasS().get(),  skin->imageBiasT().get(), (float)skin->imageLayer().get() );
+        texScale.set( skin->imageScaleS().get(), skin->imageScaleT().get(), 1.0f );
+    }
+
+    // write straight into the tile's batch for this tag and skin:
+    GeometryBatch* batch = output.getBatch( roof->getTag(), stateSet.get() );
+    unsigned start = batch->begin( _verts->size(), output.getCurrentFeature() );
+
+    const osg::Vec4f white(1,1,1,1);
+
     // scale and bias the geometry, rotate it back to its actual location,
-    // and transform into the final coordinate frame.
-    for(int i=0; i<verts->size(); ++i)
+    // and transform into the final coordinate frame. The template is a
+    // triangle list so we can calculate flat normals as we go.
+    for(unsigned i=0; i+2<_verts->size(); i+=3)
     {
-        osg::Vec3f& v = (*verts)[i];
-        v = osg::componentMultiply(v, scale) + bias;
-        elevation->unrotate( v );
-        v = v * frame;
+        osg::Vec3f v[3];
+        osg::Vec3f tx[3];
+        for(unsigned j=0; j<3; ++j)
+        {
+            v[j] = osg::componentMultiply((*_verts)[i+j], scale) + bias;
+            elevation->unrotate( v[j] );
+            v[j] = v[j] * frame;
+
+            tx[j] = (*_texCoords)[i+j];
+            tx[j].x() *= tscale.y(), tx[j].y() *= tscale.x();
+            tx[j] = texBias + osg::componentMultiply(tx[j], texScale);
+        }
+
+        osg::Vec3f n = (v[2]-v[1]) ^ (v[0]-v[1]);
+        n.normalize();
 
-        if ( texCoords )
+        for(unsigned j=0; j<3; ++j)
         {
-            osg::Vec3f& tx = (*texCoords)[i];
-            tx.x() *= tscale.y(), tx.y() *= tscale.x();         
+            batch->addVertex( v[j], n, white, tx[j] );
         }
+
+        batch->addTriangle( start+i, start+i+1, start+i+2 );
     }
 
-    // calculate normals (after transforming the vertices)
-    generateNormals( verts, normals );
+    batch->end();
+
+    return true;
+}
+
+ModelResource*
+GableRoofCompiler::getOrCreateInstanceModel(CompilerOutput&       output,
+                                            SkinResource*         skin,
+                                            const osg::Vec2f&     size,
+                                            const osgDB::Options* readOptions) const
+{
+    // the same texture repeat as the generated roofs, rounded so that
+    // roofs of similar size share a model.
+    int repeatX = 0, repeatY = 0;
+    std::string key = "untextured";
+    if ( skin )
+    {
+        repeatX = repeatToBucket( size.x() / skin->imageWidth().get() );
+        repeatY = repeatToBucket( size.y() / skin->imageHeight().get() );
 
-    // and finally the triangles.
-    geom->addPrimitiveSet( new osg::DrawArrays(GL_TRIANGLES, 0, verts->size()) );
+        // skins in different libraries may share a name, and skins in an
+        // atlas share an image; so key by the image and the placement in it.
+        key = Stringify()
+            << skin->imageURI()->full()
+            << "." << skin->imageLayer().get()
+            << "." << skin->imageBiasS().get() << "." << skin->imageBiasT().get()
+            << "." << output.getMaxTextureSize()
+            << "." << repeatX << "." << repeatY;
+    }
 
-    output.addDrawable( geom.get(), roof->getTag() );
+    {
+        Threading::ScopedMutexLock lock( _instanceModelsMutex );
+        InstanceModels::const_iterator i = _instanceModels.find( key );
+        if ( i != _instanceModels.end() )
+            return i->second.get();
+    }
 
-    return true;
+    // Build the model outside the lock since fetching the texture may load it;
+    // if two threads build the same one, the first one stored wins.
+    osg::Vec2f tscale( bucketToRepeat(repeatX), bucketToRepeat(repeatY) );
+
+    osg::Vec3f texBias(0, 0, 0);
+    osg::Vec3f texScale(1, 1, 1);
+    if ( skin )
+    {
+        texBias.set ( skin->imageBiasS().get(),  skin->imageBiasT().get(), (float)skin->imageLayer().get() );
+        texScale.set( skin->imageScaleS().get(), skin->imageScaleT().get(), 1.0f );
+    }
+
+    osg::Geometry* geom = new osg::Geometry();
+    geom->setUseVertexBufferObjects( true );
+    geom->setUseDisplayList( false );
+
+    geom->setVertexArray( new osg::Vec3Array(*_verts.get()) );
+
+    osg::Vec3Array* normals = new osg::Vec3Array();
+    generateNormals( _verts.get(), normals );
+    geom->setNormalArray( normals );
+    geom->setNormalBinding( geom->BIND_PER_VERTEX );
+
+    osg::Vec4Array* colors = new osg::Vec4Array();
+    colors->push_back( osg::Vec4f(1,1,1,1) );
+    geom->setColorArray( colors );
+    geom->setColorBinding( geom->BIND_OVERALL );
+
+    if ( skin )
+    {
+        osg::Vec3Array* texCoords = new osg::Vec3Array();
+        texCoords->reserve( _texCoords->size() );
+        for(unsigned i=0; i<_texCoords->size(); ++i)
+        {
+            osg::Vec3f tx = (*_texCoords)[i];
+            tx.x() *= tscale.y(), tx.y() *= tscale.x();
+            texCoords->push_back( texBias + osg::componentMultiply(tx, texScale) );
+        }
+        geom->setTexCoordArray( 0, texCoords );
+
+        osg::Texture* tex = output.getTexture( skin, readOptions );
+        if ( tex )
+            geom->getOrCreateStateSet()->setTextureAttributeAndModes( 0, tex, osg::StateAttribute::ON );
+    }
+
+    geom->addPrimitiveSet( new osg::DrawArrays(GL_TRIANGLES, 0, _verts->size()) );
+
+    osg::ref_ptr<ModelResource> model = new GableRoofModel( geom, skin ? skin->name() : "untextured", key );
+
+    Threading::ScopedMutexLock lock( _instanceModelsMutex );
+    osg::ref_ptr<ModelResource>& cached = _instanceModels[key];
+    if ( !cached.valid() )
+        cached = model.get();
+    return cached.get();
 }
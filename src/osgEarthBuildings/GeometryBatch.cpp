@@ -0,0 +1,158 @@
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "GeometryBatch"
+
+using namespace osgEarth;
+using namespace osgEarth::Buildings;
+
+#define LC "[GeometryBatch] "
+
+GeometryBatch::GeometryBatch(osg::StateSet* stateSet, unsigned maxVertsPerGeometry) :
+_stateSet( stateSet ),
+_textured( stateSet != 0L ),
+_maxVerts( maxVertsPerGeometry ),
+_inRange ( false )
+{
+    //nop
+}
+
+void
+GeometryBatch::startGeometry()
+{
+    osg::Geometry* geom = new osg::Geometry();
+    geom->setUseVertexBufferObjects( true );
+    geom->setUseDisplayList( false );
+
+    _verts = new osg::Vec3Array();
+    geom->setVertexArray( _verts.get() );
+
+    _normals = new osg::Vec3Array();
+    geom->setNormalArray( _normals.get() );
+    geom->setNormalBinding( geom->BIND_PER_VERTEX );
+
+    _colors = new osg::Vec4Array();
+    geom->setColorArray( _colors.get() );
+    geom->setColorBinding( geom->BIND_PER_VERTEX );
+
+    if ( _textured )
+    {
+        _texCoords = new osg::Vec3Array();
+        geom->setTexCoordArray( 0, _texCoords.get() );
+    }
+
+    _elements = new osg::DrawElementsUInt( GL_TRIANGLES );
+    geom->addPrimitiveSet( _elements.get() );
+
+    if ( _stateSet.valid() )
+        geom->setStateSet( _stateSet.get() );
+
+    _geometries.push_back( geom );
+}
+
+unsigned
+GeometryBatch::begin(unsigned numVerts, Feature* feature)
+{
+    // start a new geometry if this run would overflow the current one.
+    // A run larger than the limit still gets its own geometry.
+    if ( _geometries.empty() || (getNumVerts() > 0 && getNumVerts() + numVerts > _maxVerts) )
+    {
+        startGeometry();
+    }
+
+    unsigned start = getNumVerts();
+
+    if ( feature )
+    {
+        Range range;
+        range.geom    = _geometries.back().get();
+        range.feature = feature;
+        range.start   = start;
+        range.count   = 0;
+        _ranges.push_back( range );
+        _inRange = true;
+    }
+
+    return start;
+}
+
+void
+GeometryBatch::end()
+{
+    if ( _inRange )
+    {
+        Range& range = _ranges.back();
+        range.count = getNumVerts() - range.start;
+        _inRange = false;
+    }
+}
+
+unsigned
+GeometryBatch::getTotalNumVerts() const
+{
+    unsigned total = 0u;
+    for(unsigned i=0; i<_geometries.size(); ++i)
+    {
+        total += _geometries[i]->getVertexArray()->getNumElements();
+    }
+    return total;
+}
+
+void
+GeometryBatch::finish(osg::Geode* geode, FeatureIndexBuilder* index)
+{
+    for(unsigned i=0; i<_geometries.size(); ++i)
+    {
+        osg::Geometry* geom = _geometries[i].get();
+
+        // skip anything that never received a triangle.
+        osg::DrawElementsUInt* de = static_cast<osg::DrawElementsUInt*>(geom->getPrimitiveSet(0));
+        if ( de->empty() )
+            continue;
+
+        // use 16-bit indices when they will suffice.
+        if ( geom->getVertexArray()->getNumElements() <= 0xFFFF )
+        {
+            osg::DrawElementsUShort* de16 = new osg::DrawElementsUShort( GL_TRIANGLES );
+            de16->reserve( de->size() );
+            for(osg::DrawElementsUInt::const_iterator e = de->begin(); e != de->end(); ++e)
+                de16->push_back( (GLushort)(*e) );
+            geom->setPrimitiveSet( 0, de16 );
+        }
+
+        geode->addDrawable( geom );
+    }
+
+    // now that the arrays are complete we can tag the feature ranges.
+    if ( index )
+    {
+        for(Ranges::const_iterator r = _ranges.begin(); r != _ranges.end(); ++r)
+        {
+            if ( r->count > 0 )
+            {
+                index->tagRange( r->geom, r->feature.get(), r->start, r->count );
+            }
+        }
+    }
+
+    _ranges.clear();
+    _verts     = 0L;
+    _normals   = 0L;
+    _colors    = 0L;
+    _texCoords = 0L;
+    _elements  = 0L;
+}
@@ -0,0 +1,306 @@
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "HiddenFaceRemover"
+#include <algorithm>
+#include <cmath>
+
+using namespace osgEarth;
+using namespace osgEarth::Buildings;
+
+#define LC "[HiddenFaceRemover] "
+
+// size of the grid cells used to find neighboring walls
+#define CELL_SIZE 16.0
+
+namespace
+{
+    inline double cross2d(const osg::Vec3d& a, const osg::Vec3d& b)
+    {
+        return a.x()*b.y() - a.y()*b.x();
+    }
+
+    // Distance in XY from p to the segment ab.
+    double distanceToSegment(const osg::Vec3d& p, const osg::Vec3d& a, const osg::Vec3d& b)
+    {
+        osg::Vec3d ab(b.x()-a.x(), b.y()-a.y(), 0.0);
+        osg::Vec3d ap(p.x()-a.x(), p.y()-a.y(), 0.0);
+        double len2 = ab.length2();
+        double t = len2 > 0.0 ? osg::clampBetween((ap*ab)/len2, 0.0, 1.0) : 0.0;
+        return (ap - ab*t).length();
+    }
+
+    // True if p is inside the outline or within "tolerance" of its boundary.
+    bool insideOrOn(const osg::Vec3d& p, const Elevation::Faces& outline, double tolerance)
+    {
+        bool inside = false;
+        for(Elevation::Faces::const_iterator f = outline.begin(); f != outline.end(); ++f)
+        {
+            const osg::Vec3d& a = f->left.lower;
+            const osg::Vec3d& b = f->right.lower;
+
+            if ( distanceToSegment(p, a, b) <= tolerance )
+                return true;
+
+            if ( ((a.y() > p.y()) != (b.y() > p.y())) &&
+                 (p.x() < (b.x()-a.x()) * (p.y()-a.y()) / (b.y()-a.y()) + a.x()) )
+            {
+                inside = !inside;
+            }
+        }
+        return inside;
+    }
+
+    struct Interval
+    {
+        double t0, t1, top;
+        bool operator < (const Interval& rhs) const { return t0 < rhs.t0; }
+    };
+}
+
+HiddenFaceRemover::HiddenFaceRemover(float tolerance) :
+_tolerance( tolerance )
+{
+    //nop
+}
+
+void
+HiddenFaceRemover::add(Building* building, const osg::Matrix& world2local)
+{
+    if ( !building )
+        return;
+
+    osg::Matrix frame = building->getReferenceFrame() * world2local;
+
+    for(ElevationVector::iterator e = building->getElevations().begin(); e != building->getElevations().end(); ++e)
+    {
+        addElevation( e->get(), frame );
+    }
+}
+
+void
+HiddenFaceRemover::addElevation(Elevation* elevation, const osg::Matrix& frame)
+{
+    unsigned owner = _elevations.size();
+    _elevations.push_back( elevation );
+
+    Elevation::Walls& walls = elevation->getWalls();
+    for(Elevation::Walls::iterator wall = walls.begin(); wall != walls.end(); ++wall)
+    {
+        for(Elevation::Faces::iterator face = wall->faces.begin(); face != wall->faces.end(); ++face)
+        {
+            Segment seg;
+            seg.face   = &(*face);
+            seg.a      = face->left.lower * frame;
+            seg.b      = face->right.lower * frame;
+            seg.bottom = std::min( seg.a.z(), seg.b.z() );
+            seg.top    = seg.bottom + (face->left.upper - face->left.lower).length();
+
+            unsigned index = _segments.size();
+            _segments.push_back( seg );
+            _owners.push_back( owner );
+
+            std::vector< std::pair<int,int> > cells;
+            getCells( seg, cells );
+            for(unsigned c=0; c<cells.size(); ++c)
+                _grid[cells[c]].push_back( index );
+        }
+    }
+
+    for(ElevationVector::iterator child = elevation->getElevations().begin(); child != elevation->getElevations().end(); ++child)
+    {
+        addElevation( child->get(), frame );
+        hideInsideParent( child->get(), elevation );
+    }
+}
+
+void
+HiddenFaceRemover::hideInsideParent(Elevation* child, const Elevation* parent)
+{
+    if ( parent->getWalls().empty() )
+        return;
+
+    // Both elevations are in the building's frame, so they compare directly.
+    const Elevation::Faces& outline = parent->getWalls().front().faces;
+    float parentTop = parent->getTop();
+
+    Elevation::Walls& walls = child->getWalls();
+    for(Elevation::Walls::iterator wall = walls.begin(); wall != walls.end(); ++wall)
+    {
+        for(Elevation::Faces::iterator face = wall->faces.begin(); face != wall->faces.end(); ++face)
+        {
+            float bottom = face->left.lower.z();
+            if ( bottom >= parentTop )
+                continue;
+
+            const osg::Vec3d& a = face->left.lower;
+            const osg::Vec3d& b = face->right.lower;
+
+            if ( insideOrOn(a, outline, _tolerance) &&
+                 insideOrOn(b, outline, _tolerance) &&
+                 insideOrOn((a+b)*0.5, outline, _tolerance) )
+            {
+                face->hiddenHeight = std::max( face->hiddenHeight, parentTop - bottom );
+            }
+        }
+    }
+}
+
+void
+HiddenFaceRemover::getCells(const Segment& seg, std::vector<std::pair<int,int> >& cells) const
+{
+    int x0 = (int)floor( (std::min(seg.a.x(), seg.b.x()) - _tolerance) / CELL_SIZE );
+    int x1 = (int)floor( (std::max(seg.a.x(), seg.b.x()) + _tolerance) / CELL_SIZE );
+    int y0 = (int)floor( (std::min(seg.a.y(), seg.b.y()) - _tolerance) / CELL_SIZE );
+    int y1 = (int)floor( (std::max(seg.a.y(), seg.b.y()) + _tolerance) / CELL_SIZE );
+
+    for(int y=y0; y<=y1; ++y)
+        for(int x=x0; x<=x1; ++x)
+            cells.push_back( std::make_pair(x, y) );
+}
+
+void
+HiddenFaceRemover::hideBackToBack(Segment& seg, const std::vector<unsigned>& candidates)
+{
+    osg::Vec3d u = seg.b - seg.a;
+    u.z() = 0.0;
+    double len = u.normalize();
+    if ( len < _tolerance )
+        return;
+
+    // Collect the stretches of this face that opposing, coincident faces cover.
+    std::vector<Interval> intervals;
+    for(unsigned i=0; i<candidates.size(); ++i)
+    {
+        const Segment& other = _segments[candidates[i]];
+
+        osg::Vec3d v = other.b - other.a;
+        v.z() = 0.0;
+        if ( v.normalize() < _tolerance || u*v > -0.99 )
+            continue;
+
+        if ( fabs(cross2d(u, other.a - seg.a)) > _tolerance ||
+             fabs(cross2d(u, other.b - seg.a)) > _tolerance ||
+             other.bottom > seg.bottom + _tolerance )
+            continue;
+
+        double ta = (other.a - seg.a) * u;
+        double tb = (other.b - seg.a) * u;
+
+        Interval interval;
+        interval.t0  = std::max( std::min(ta, tb), 0.0 );
+        interval.t1  = std::min( std::max(ta, tb), len );
+        interval.top = other.top;
+        if ( interval.t1 > interval.t0 )
+            intervals.push_back( interval );
+    }
+
+    if ( intervals.empty() )
+        return;
+
+    std::sort( intervals.begin(), intervals.end() );
+
+    // Find the greatest height up to which the whole face is covered.
+    std::vector<double> tops;
+    for(unsigned i=0; i<intervals.size(); ++i)
+        tops.push_back( intervals[i].top );
+    std::sort( tops.begin(), tops.end() );
+
+    for(std::vector<double>::reverse_iterator h = tops.rbegin(); h != tops.rend(); ++h)
+    {
+        double reach = 0.0;
+        for(unsigned i=0; i<intervals.size() && reach < len - _tolerance; ++i)
+        {
+            if ( intervals[i].top >= *h && intervals[i].t0 <= reach + _tolerance )
+                reach = std::max( reach, intervals[i].t1 );
+        }
+
+        if ( reach >= len - _tolerance )
+        {
+            float hidden = (float)(std::min(*h, seg.top) - seg.bottom);
+            seg.face->hiddenHeight = std::max( seg.face->hiddenHeight, hidden );
+            return;
+        }
+    }
+}
+
+unsigned
+HiddenFaceRemover::run(bool instancedBoxes)
+{
+    std::vector<unsigned> candidates;
+
+    for(unsigned i=0; i<_segments.size(); ++i)
+    {
+        Segment& seg = _segments[i];
+
+        // gather the faces of other elevations near this one:
+        std::vector< std::pair<int,int> > cells;
+        getCells( seg, cells );
+
+        candidates.clear();
+        for(unsigned c=0; c<cells.size(); ++c)
+        {
+            Grid::const_iterator cell = _grid.find( cells[c] );
+            if ( cell == _grid.end() )
+                continue;
+
+            for(unsigned k=0; k<cell->second.size(); ++k)
+            {
+                if ( _owners[cell->second[k]] != _owners[i] )
+                    candidates.push_back( cell->second[k] );
+            }
+        }
+
+        std::sort( candidates.begin(), candidates.end() );
+        candidates.erase( std::unique(candidates.begin(), candidates.end()), candidates.end() );
+
+        if ( !candidates.empty() )
+            hideBackToBack( seg, candidates );
+    }
+
+    // Count the wall triangles that the compiler will skip (two per floor).
+    unsigned numTriangles = 0u;
+    for(unsigned e=0; e<_elevations.size(); ++e)
+    {
+        const Elevation* elevation = _elevations[e];
+        if ( instancedBoxes && elevation->getRenderAsBox() )
+            continue;
+
+        unsigned numFloors = (unsigned)elevation->getNumFloors();
+        if ( numFloors == 0u )
+            continue;
+
+        float floorHeight = elevation->getHeight() / (float)numFloors;
+        if ( floorHeight <= 0.0f )
+            continue;
+
+        const Elevation::Walls& walls = elevation->getWalls();
+        for(Elevation::Walls::const_iterator wall = walls.begin(); wall != walls.end(); ++wall)
+        {
+            for(Elevation::Faces::const_iterator face = wall->faces.begin(); face != wall->faces.end(); ++face)
+            {
+                if ( face->hiddenHeight > 0.0f )
+                {
+                    unsigned hiddenFloors = (unsigned)((face->hiddenHeight + 0.01f) / floorHeight);
+                    numTriangles += 2u * std::min(hiddenFloors, numFloors);
+                }
+            }
+        }
+    }
+
+    return numTriangles;
+}
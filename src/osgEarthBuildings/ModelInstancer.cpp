@@ -0,0 +1,201 @@
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "ModelInstancer"
+#include "BuildingShaders"
+#include "Morton"
+#include <osgEarth/VirtualProgram>
+#include <osg/Geode>
+#include <osg/Geometry>
+#include <osg/LOD>
+#include <osg/NodeVisitor>
+#include <osg/TextureBuffer>
+#include <algorithm>
+
+using namespace osgEarth;
+using namespace osgEarth::Buildings;
+
+#define LC "[ModelInstancer] "
+
+namespace
+{
+    // Prepares every geometry in a (copied) model for instanced drawing.
+    struct SetupInstancing : public osg::NodeVisitor
+    {
+        unsigned         _numInstances;
+        osg::BoundingBox _bounds;
+
+        SetupInstancing(unsigned numInstances, const osg::BoundingBox& bounds) :
+            osg::NodeVisitor(TRAVERSE_ALL_CHILDREN),
+            _numInstances( numInstances ),
+            _bounds( bounds )
+        {
+            setNodeMaskOverride(~0);
+        }
+
+        void apply(osg::Geode& geode)
+        {
+            for(unsigned i=0; i<geode.getNumDrawables(); ++i)
+            {
+                osg::Geometry* geom = geode.getDrawable(i)->asGeometry();
+                if ( !geom )
+                    continue;
+
+                // instancing requires VBOs. (Check first; the arrays may be shared.)
+                if ( !geom->getUseVertexBufferObjects() || geom->getUseDisplayList() )
+                {
+                    geom->setUseVertexBufferObjects( true );
+                    geom->setUseDisplayList( false );
+                }
+
+                for(unsigned p=0; p<geom->getNumPrimitiveSets(); ++p)
+                    geom->getPrimitiveSet(p)->setNumInstances( _numInstances );
+
+                // OSG cannot see where the instances are, so supply the bounds.
+                geom->setInitialBound( _bounds );
+            }
+        }
+    };
+}
+
+osg::Group*
+ModelInstancer::createInstancedNode(osg::Node*                      model,
+                                    const std::vector<osg::Matrix>& matrices,
+                                    unsigned                        instancesPerCell,
+                                    float                           maxRange)
+{
+    osg::Group* group = new osg::Group();
+    if ( !model || matrices.empty() )
+        return group;
+
+    instancesPerCell = osg::clampBetween(instancesPerCell, 1u, MAX_INSTANCES_PER_BUFFER);
+
+    // the model's bounds, to transform into instance bounds:
+    osg::BoundingSphere modelBound = model->getBound();
+    float r = modelBound.radius();
+
+    // Sort the instances along a Z-order curve so that consecutive runs
+    // (the cells) are spatially compact.
+    osg::BoundingBox extent;
+    for(unsigned i=0; i<matrices.size(); ++i)
+        extent.expandBy( matrices[i].getTrans() );
+
+    std::vector< std::pair<unsigned, unsigned> > order( matrices.size() );
+    for(unsigned i=0; i<matrices.size(); ++i)
+        order[i] = std::make_pair( mortonCode(matrices[i].getTrans(), extent), i );
+    std::sort( order.begin(), order.end() );
+
+    // Buffers hold a whole number of cells so a cell never straddles two.
+    unsigned instancesPerBuffer = (MAX_INSTANCES_PER_BUFFER / instancesPerCell) * instancesPerCell;
+
+    for(unsigned first = 0; first < order.size(); first += instancesPerBuffer)
+    {
+        unsigned count = std::min(instancesPerBuffer, (unsigned)order.size() - first);
+
+        osg::Image* image = new osg::Image();
+        image->allocateImage( count * TEXELS_PER_INSTANCE, 1, 1, GL_RGBA, GL_FLOAT );
+        image->setInternalTextureFormat( GL_RGBA32F_ARB );
+
+        osg::Vec4f* texels = reinterpret_cast<osg::Vec4f*>(image->data());
+
+        // conservative bounds of each instance: the transformed box around the model's sphere.
+        std::vector<osg::BoundingBox> cellBounds( (count + instancesPerCell - 1) / instancesPerCell );
+        osg::BoundingBox bufferBounds;
+
+        for(unsigned i=0; i<count; ++i)
+        {
+            const osg::Matrix& m = matrices[ order[first+i].second ];
+
+            // the first three columns of the matrix, such that
+            // position.x = dot(vec4(vertex, 1), column0) and so on.
+            for(unsigned c=0; c<3; ++c)
+                *texels++ = osg::Vec4f( m(0,c), m(1,c), m(2,c), m(3,c) );
+
+            osg::BoundingBox& bounds = cellBounds[i / instancesPerCell];
+            for(unsigned k=0; k<8; ++k)
+            {
+                osg::Vec3d corner(
+                    modelBound.center().x() + ((k&1)? r : -r),
+                    modelBound.center().y() + ((k&2)? r : -r),
+                    modelBound.center().z() + ((k&4)? r : -r) );
+                bounds.expandBy( corner * m );
+            }
+            bufferBounds.expandBy( bounds );
+        }
+
+        osg::TextureBuffer* tbo = new osg::TextureBuffer( image );
+        tbo->setInternalFormat( GL_RGBA32F_ARB );
+
+        osg::Group* buffer = new osg::Group();
+        buffer->getOrCreateStateSet()->setTextureAttribute( TBO_UNIT, tbo );
+        group->addChild( buffer );
+
+        // Share everything but the nodes and primitive sets, which carry the instance count.
+        // Every full cell draws the same count, so they all share one copy; the cells
+        // supply the bounds that culling uses, so the copy just covers the buffer.
+        osg::ref_ptr<osg::Node> fullCopy;
+
+        for(unsigned c=0; c<cellBounds.size(); ++c)
+        {
+            unsigned offset = c * instancesPerCell;
+            unsigned cellCount = std::min(instancesPerCell, count - offset);
+
+            osg::ref_ptr<osg::Node> copy;
+            if ( cellCount == instancesPerCell )
+                copy = fullCopy.get();
+
+            if ( !copy.valid() )
+            {
+                copy = osg::clone( model,
+                    osg::CopyOp::DEEP_COPY_NODES | osg::CopyOp::DEEP_COPY_DRAWABLES | osg::CopyOp::DEEP_COPY_PRIMITIVES );
+
+                SetupInstancing setup( cellCount, bufferBounds );
+                copy->accept( setup );
+
+                if ( cellCount == instancesPerCell )
+                    fullCopy = copy.get();
+            }
+
+            // An LOD with a user-defined center reports exactly the cell's bound.
+            const osg::BoundingBox& bounds = cellBounds[c];
+            osg::LOD* cell = new osg::LOD();
+            cell->setCenterMode( osg::LOD::USER_DEFINED_CENTER );
+            cell->setCenter( bounds.center() );
+            cell->setRadius( bounds.radius() );
+            cell->addChild( copy.get(), 0.0f, maxRange );
+            cell->getOrCreateStateSet()->addUniform( new osg::Uniform("oeb_instance_offset", (int)offset) );
+            buffer->addChild( cell );
+        }
+    }
+
+    return group;
+}
+
+void
+ModelInstancer::installShaders(osg::StateSet* stateSet)
+{
+    if ( !stateSet ) return;
+
+    VirtualProgram* vp = VirtualProgram::getOrCreate(stateSet);
+    vp->setName("Buildings instances");
+
+    BuildingShaders shaders;
+    shaders.load(vp, shaders.InstanceVertex);
+
+    stateSet->addUniform( new osg::Uniform("oeb_instance_tbo", TBO_UNIT) );
+    stateSet->addUniform( new osg::Uniform("oeb_instance_offset", 0) );
+}
@@ -0,0 +1,340 @@
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "ProxyCompiler"
+#include "Elevation"
+#include "Roof"
+#include <osgEarth/ImageUtils>
+#include <osgEarth/StringUtils>
+#include <algorithm>
+#include <cmath>
+
+using namespace osgEarth;
+using namespace osgEarth::Buildings;
+
+#define LC "[ProxyCompiler] "
+
+namespace
+{
+    // Height of the tallest elevation in a stack, relative to the ground.
+    float getStackTop(const Elevation* elevation)
+    {
+        float top = elevation->getTop();
+        for(ElevationVector::const_iterator e = elevation->getElevations().begin(); e != elevation->getElevations().end(); ++e)
+            top = std::max(top, getStackTop(e->get()));
+        return top;
+    }
+
+    // Orders boxes so the ones that matter most from a distance come first.
+    struct LargerBox
+    {
+        template<typename T>
+        bool operator()(const T& lhs, const T& rhs) const
+        {
+            return lhs.area*lhs.height > rhs.area*rhs.height;
+        }
+    };
+}
+
+osg::Vec4f
+ProxyColorCache::get(SkinResource* skin, CompilerOutput& output, const osgDB::Options* readOptions)
+{
+    const osg::Vec4f gray(0.7f, 0.7f, 0.7f, 1.0f);
+    if ( !skin || !skin->imageURI().isSet() )
+        return gray;
+
+    std::string key = Stringify() << skin->imageURI()->full() << "#" << skin->imageLayer().get();
+
+    {
+        Threading::ScopedMutexLock lock(_mutex);
+        std::map<std::string, osg::Vec4f>::const_iterator i = _cache.find(key);
+        if ( i != _cache.end() )
+            return i->second;
+    }
+
+    // Sample outside the lock since fetching the texture may load it; two
+    // threads may both sample a skin, but they get the same color.
+    osg::Vec4f color = gray;
+
+    // Sample a grid across the skin's rectangle in the atlas (or its layer in an array).
+    osg::Texture* tex = output.getTexture(skin, readOptions);
+    const osg::Image* image = tex ? tex->getImage( tex->getNumImages() > 1u ? (unsigned)skin->imageLayer().get() : 0u ) : 0L;
+    if ( image && ImageUtils::PixelReader::supports(image) )
+    {
+        ImageUtils::PixelReader read(image);
+        const unsigned n = 16u;
+        osg::Vec4f sum;
+        for(unsigned t=0; t<n; ++t)
+        {
+            for(unsigned s=0; s<n; ++s)
+            {
+                float u = skin->imageBiasS().get() + skin->imageScaleS().get() * ((float)s + 0.5f) / (float)n;
+                float v = skin->imageBiasT().get() + skin->imageScaleT().get() * ((float)t + 0.5f) / (float)n;
+                sum += read(u, v);
+            }
+        }
+        color = sum / (float)(n*n);
+        color.a() = 1.0f;
+    }
+
+    Threading::ScopedMutexLock lock(_mutex);
+    _cache[key] = color;
+    return color;
+}
+
+ProxyCompiler::ProxyCompiler(float cellSize, unsigned vertexBudget, ProxyColorCache* colors) :
+_cellSize    ( cellSize ),
+_vertexBudget( vertexBudget ),
+_colors      ( colors ),
+_numBuildings( 0u )
+{
+    //nop
+}
+
+void
+ProxyCompiler::add(const Building* building, CompilerOutput& output, const osgDB::Options* readOptions)
+{
+    if ( !building || building->getElevations().empty() )
+        return;
+
+    ++_numBuildings;
+
+    osg::Matrix frame = building->getReferenceFrame() * output.getWorldToLocal();
+
+    for(ElevationVector::const_iterator e = building->getElevations().begin(); e != building->getElevations().end(); ++e)
+    {
+        addElevation( e->get(), frame, output, readOptions );
+    }
+}
+
+void
+ProxyCompiler::addElevation(const Elevation*      elevation,
+                            const osg::Matrix&    frame,
+                            CompilerOutput&       output,
+                            const osgDB::Options* readOptions)
+{
+    // The AABB is in the elevation's rotated space, so the box follows the footprint's main axis.
+    const osg::BoundingBox& aabb = elevation->getAxisAlignedBoundingBox();
+    if ( !aabb.valid() )
+        return;
+
+    float bottom = elevation->getBottom();
+    float height = getStackTop(elevation) - bottom;
+    float area   = (aabb.xMax()-aabb.xMin()) * (aabb.yMax()-aabb.yMin());
+    if ( height <= 0.0f || area <= 0.0f )
+        return;
+
+    osg::Matrix toLocal = elevation->getRotation() * frame;
+
+    Box box;
+    box.corners[0] = osg::Vec3d(aabb.xMin(), aabb.yMin(), bottom) * toLocal;
+    box.corners[1] = osg::Vec3d(aabb.xMax(), aabb.yMin(), bottom) * toLocal;
+    box.corners[2] = osg::Vec3d(aabb.xMax(), aabb.yMax(), bottom) * toLocal;
+    box.corners[3] = osg::Vec3d(aabb.xMin(), aabb.yMax(), bottom) * toLocal;
+    box.height = height;
+    box.area   = area;
+
+    // the corners must wind counter-clockwise for the wall normals to face out.
+    osg::Vec3d e0 = box.corners[1] - box.corners[0], e1 = box.corners[2] - box.corners[1];
+    if ( e0.x()*e1.y() - e0.y()*e1.x() < 0.0 )
+        std::swap( box.corners[1], box.corners[3] );
+
+    // Without textures, color each part with its skin's average color.
+    ProxyColorCache* colors = _colors.get();
+    box.wallColor = elevation->getColor();
+    if ( colors && elevation->getSkinResource() )
+        box.wallColor = osg::componentMultiply( box.wallColor, colors->get(elevation->getSkinResource(), output, readOptions) );
+
+    const Roof* roof = elevation->getRoof();
+    box.roofColor = roof ? osg::Vec4f(roof->getColor()) : box.wallColor;
+    if ( colors && roof && roof->getSkinResource() )
+        box.roofColor = osg::componentMultiply( box.roofColor, colors->get(roof->getSkinResource(), output, readOptions) );
+
+    _boxes.push_back( box );
+}
+
+void
+ProxyCompiler::merge(Boxes& boxes) const
+{
+    if ( _cellSize <= 0.0f )
+        return;
+
+    // Bin the boxes that are smaller than a cell by the cell their center falls in.
+    typedef std::map< std::pair<int,int>, std::vector<unsigned> > Cells;
+    Cells cells;
+    std::vector<bool> merged( boxes.size(), false );
+
+    for(unsigned i=0; i<boxes.size(); ++i)
+    {
+        osg::BoundingBox bb;
+        for(unsigned c=0; c<4; ++c)
+            bb.expandBy( boxes[i].corners[c] );
+
+        if ( bb.xMax()-bb.xMin() < _cellSize && bb.yMax()-bb.yMin() < _cellSize )
+        {
+            osg::Vec3d center = bb.center();
+            cells[ std::make_pair( (int)floor(center.x()/_cellSize), (int)floor(center.y()/_cellSize) ) ].push_back( i );
+        }
+    }
+
+    Boxes output;
+    for(Cells::const_iterator cell = cells.begin(); cell != cells.end(); ++cell)
+    {
+        const std::vector<unsigned>& members = cell->second;
+        if ( members.size() < 2 )
+            continue;
+
+        // One block replaces the cell's buildings. It keeps their total footprint
+        // area and the proportions of their combined extent, centered on their
+        // area-weighted centroid, with their area-weighted height and colors.
+        osg::BoundingBox extent;
+        osg::Vec3d centroid;
+        osg::Vec4f wallColor, roofColor;
+        double area = 0.0, height = 0.0;
+
+        for(unsigned m=0; m<members.size(); ++m)
+        {
+            const Box& box = boxes[members[m]];
+            osg::Vec3d center;
+            for(unsigned c=0; c<4; ++c)
+            {
+                extent.expandBy( box.corners[c] );
+                center += box.corners[c] * 0.25;
+            }
+            centroid  += center * box.area;
+            wallColor += box.wallColor * box.area;
+            roofColor += box.roofColor * box.area;
+            height    += box.height * box.area;
+            area      += box.area;
+            merged[members[m]] = true;
+        }
+
+        centroid  /= area;
+        wallColor /= area;
+        roofColor /= area;
+        height    /= area;
+
+        double w = extent.xMax()-extent.xMin(), d = extent.yMax()-extent.yMin();
+        double hw = 0.5 * std::min( w, sqrt(area * w / d) );
+        double hd = 0.5 * std::min( d, area / (2.0*hw) );
+
+        Box block;
+        block.corners[0].set( centroid.x()-hw, centroid.y()-hd, centroid.z() );
+        block.corners[1].set( centroid.x()+hw, centroid.y()-hd, centroid.z() );
+        block.corners[2].set( centroid.x()+hw, centroid.y()+hd, centroid.z() );
+        block.corners[3].set( centroid.x()-hw, centroid.y()+hd, centroid.z() );
+        block.height    = height;
+        block.area      = 4.0*hw*hd;
+        block.wallColor = wallColor;
+        block.roofColor = roofColor;
+        output.push_back( block );
+    }
+
+    for(unsigned i=0; i<boxes.size(); ++i)
+    {
+        if ( !merged[i] )
+            output.push_back( boxes[i] );
+    }
+
+    boxes.swap( output );
+}
+
+void
+ProxyCompiler::write(const Box& box, GeometryBatch* batch) const
+{
+    unsigned vertPtr = batch->begin( VERTS_PER_BOX, 0L );
+    osg::Vec3d up(0.0, 0.0, box.height);
+    const osg::Vec3f noTexture;
+
+    for(unsigned i=0; i<4; ++i, vertPtr += 4)
+    {
+        const osg::Vec3d& L = box.corners[i];
+        const osg::Vec3d& R = box.corners[(i+1)%4];
+
+        osg::Vec3f n( R.y()-L.y(), L.x()-R.x(), 0.0f );
+        n.normalize();
+
+        batch->addVertex( L+up, n, box.wallColor, noTexture );
+        batch->addVertex( L,    n, box.wallColor, noTexture );
+        batch->addVertex( R,    n, box.wallColor, noTexture );
+        batch->addVertex( R+up, n, box.wallColor, noTexture );
+
+        batch->addTriangle( vertPtr+0, vertPtr+1, vertPtr+2 );
+        batch->addTriangle( vertPtr+0, vertPtr+2, vertPtr+3 );
+    }
+
+    const osg::Vec3f n(0.0f, 0.0f, 1.0f);
+    for(unsigned i=0; i<4; ++i)
+        batch->addVertex( box.corners[i]+up, n, box.roofColor, noTexture );
+
+    batch->addTriangle( vertPtr+0, vertPtr+1, vertPtr+2 );
+    batch->addTriangle( vertPtr+0, vertPtr+2, vertPtr+3 );
+
+    batch->end();
+}
+
+void
+ProxyCompiler::compile(CompilerOutput& output, ProgressCallback* progress)
+{
+    unsigned numCollected = _boxes.size();
+
+    merge( _boxes );
+
+    // Merging moves buildings by up to a cell.
+    if ( _boxes.size() < numCollected )
+        output.expandGeometricError( _cellSize );
+
+    // Buildings that are still smaller than a quarter cell will not be missed.
+    float minArea = 0.0625f * _cellSize * _cellSize;
+
+    std::sort( _boxes.begin(), _boxes.end(), LargerBox() );
+
+    unsigned maxBoxes = _vertexBudget / VERTS_PER_BOX;
+    unsigned numWritten = 0u;
+
+    GeometryBatch* batch = 0L;
+    Boxes::const_iterator box = _boxes.begin();
+    for( ; box != _boxes.end() && numWritten < maxBoxes; ++box)
+    {
+        if ( box->area < minArea )
+        {
+            output.expandGeometricError( osg::maximum(sqrtf(box->area), box->height) );
+            continue;
+        }
+
+        if ( !batch )
+            batch = output.getBatch( "", 0L );
+
+        write( *box, batch );
+        ++numWritten;
+    }
+
+    // Boxes over the budget are left out too.
+    for( ; box != _boxes.end(); ++box)
+    {
+        output.expandGeometricError( osg::maximum(sqrtf(box->area), box->height) );
+    }
+
+    if ( progress && progress->collectStats() )
+    {
+        progress->stats("# proxy buildings") = _numBuildings;
+        progress->stats("# proxy input boxes") = numCollected;
+        progress->stats("# proxy boxes") = numWritten;
+    }
+
+    _boxes.clear();
+}
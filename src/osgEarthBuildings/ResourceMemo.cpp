@@ -0,0 +1,174 @@
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "ResourceMemo"
+#include <cmath>
+#include <climits>
+
+using namespace osgEarth;
+using namespace osgEarth::Symbology;
+using namespace osgEarth::Buildings;
+
+#define LC "[ResourceMemo] "
+
+namespace
+{
+    // sizes per octave
+    const float BUCKETS_PER_OCTAVE = 4.0f;
+
+    int sizeToBucket(float size)
+    {
+        return size > 0.0f ? (int)floor(log(size)/log(2.0f) * BUCKETS_PER_OCTAVE) : INT_MIN;
+    }
+
+    float bucketToSize(int bucket)
+    {
+        return bucket == INT_MIN ? 0.0f : pow(2.0f, (float)bucket / BUCKETS_PER_OCTAVE);
+    }
+}
+
+ResourceMemo::Key::Key() :
+library( 0L ),
+symbol ( 0L ),
+tiled  ( -1 ),
+sizeX  ( 0 ),
+sizeY  ( 0 ),
+sized  ( false )
+{
+    //nop
+}
+
+bool
+ResourceMemo::Key::operator < (const Key& rhs) const
+{
+    if ( library != rhs.library ) return library < rhs.library;
+    if ( symbol != rhs.symbol )   return symbol < rhs.symbol;
+    if ( tiled != rhs.tiled )     return tiled < rhs.tiled;
+    if ( sized != rhs.sized )     return sized < rhs.sized;
+    if ( sizeX != rhs.sizeX )     return sizeX < rhs.sizeX;
+    if ( sizeY != rhs.sizeY )     return sizeY < rhs.sizeY;
+    return tag < rhs.tag;
+}
+
+const SkinResourceVector&
+ResourceMemo::getSkins(ResourceLibrary*       library,
+                       const SkinSymbol*      symbol,
+                       const optional<bool>&  tiled,
+                       const osgDB::Options*  dbo)
+{
+    Key key;
+    key.library = library;
+    key.symbol  = symbol;
+    key.tiled   = tiled.isSet() ? (tiled.get() ? 1 : 0) : -1;
+
+    {
+        Threading::ScopedMutexLock lock(_mutex);
+        std::map<Key, Entry<SkinResourceVector> >::const_iterator i = _skins.find(key);
+        if ( i != _skins.end() )
+            return i->second.candidates;
+    }
+
+    // Match outside the lock. Variations go on a copy, since the
+    // symbol is shared by every building made from the same template.
+    Entry<SkinResourceVector> entry;
+    entry.library = library;
+    entry.symbol  = symbol;
+
+    if ( tiled.isSet() )
+    {
+        osg::ref_ptr<SkinSymbol> copy = new SkinSymbol(*symbol);
+        copy->isTiled() = tiled.get();
+        library->getSkins( copy.get(), entry.candidates, dbo );
+    }
+    else
+    {
+        library->getSkins( symbol, entry.candidates, dbo );
+    }
+
+    // another thread may have beaten us to it; the first one in stays.
+    Threading::ScopedMutexLock lock(_mutex);
+    return _skins.insert( std::make_pair(key, entry) ).first->second.candidates;
+}
+
+const ModelResourceVector&
+ResourceMemo::getModels(ResourceLibrary*       library,
+                        const ModelSymbol*     symbol,
+                        const std::string&     extraTag,
+                        const osgDB::Options*  dbo)
+{
+    Key key;
+    key.library = library;
+    key.symbol  = symbol;
+    key.tag     = extraTag;
+    return getModels( library, symbol, key, dbo );
+}
+
+const ModelResourceVector&
+ResourceMemo::getModels(ResourceLibrary*       library,
+                        const ModelSymbol*     symbol,
+                        float                  maxSizeX,
+                        float                  maxSizeY,
+                        const osgDB::Options*  dbo)
+{
+    Key key;
+    key.library = library;
+    key.symbol  = symbol;
+    key.sized   = true;
+    key.sizeX   = sizeToBucket(maxSizeX);
+    key.sizeY   = sizeToBucket(maxSizeY);
+    return getModels( library, symbol, key, dbo );
+}
+
+const ModelResourceVector&
+ResourceMemo::getModels(ResourceLibrary*       library,
+                        const ModelSymbol*     symbol,
+                        const Key&             key,
+                        const osgDB::Options*  dbo)
+{
+    {
+        Threading::ScopedMutexLock lock(_mutex);
+        std::map<Key, Entry<ModelResourceVector> >::const_iterator i = _models.find(key);
+        if ( i != _models.end() )
+            return i->second.candidates;
+    }
+
+    Entry<ModelResourceVector> entry;
+    entry.library = library;
+    entry.symbol  = symbol;
+
+    if ( key.sized || !key.tag.empty() )
+    {
+        osg::ref_ptr<ModelSymbol> copy = new ModelSymbol(*symbol);
+        if ( !key.tag.empty() )
+        {
+            copy->addTags( key.tag );
+        }
+        if ( key.sized )
+        {
+            copy->maxSizeX() = bucketToSize(key.sizeX);
+            copy->maxSizeY() = bucketToSize(key.sizeY);
+        }
+        library->getModels( copy.get(), entry.candidates, dbo );
+    }
+    else
+    {
+        library->getModels( symbol, entry.candidates, dbo );
+    }
+
+    Threading::ScopedMutexLock lock(_mutex);
+    return _models.insert( std::make_pair(key, entry) ).first->second.candidates;
+}
@@ -90,17 +90,21 @@ Roof::resolveSkin(const Polygon* footprint, BuildContext& bc)
         // the roof type and the difference in area between the actual footprint
         // and the bounding polygon.
         const osg::BoundingBox& aabb = getParent()->getAxisAlignedBoundingBox();
+
+        // The symbol is shared with the catalog template, so the tiling
+        // choice is passed along to the lookup rather than written to it.
+        optional<bool> tiled;
         
         if ( !getSkinSymbol()->name().isSet() )
         {
-            getSkinSymbol()->isTiled() = true;
+            tiled = true;
         
             // if this is the top-most roof, consider a non-tiled texture. It should also
             // be low aspect ratio (not too stretched out).
             if (getType() == TYPE_FLAT &&
                 (getParent()->getElevations().empty() || dynamic_cast<Parapet*>(getParent()->getElevations().front().get())))
             {
-                getSkinSymbol()->isTiled() = false;
+                tiled = false;
 
 #if 0
                 float aabbWidth = (aabb.xMax()-aabb.xMin()), aabbHeight = (aabb.yMax()-aabb.yMin());
@@ -112,7 +116,7 @@ Roof::resolveSkin(const Polygon* footprint, BuildContext& bc)
                     float ratio    = fabs( polyArea/aabbArea );
                     if ( ratio > 0.99f )
                     {
-                        getSkinSymbol()->isTiled() = false;
+                        tiled = false;
                     }
                 }
 #endif
@@ -120,8 +124,8 @@ Roof::resolveSkin(const Polygon* footprint, BuildContext& bc)
         }
 
         // resolve the resource.
-        SkinResourceVector candidates;
-        bc.getResourceLibrary()->getSkins(getSkinSymbol(), candidates, bc.getDBOptions() );
+        const SkinResourceVector& candidates = bc.getResourceMemo()->getSkins(
+            bc.getResourceLibrary(), getSkinSymbol(), tiled, bc.getDBOptions() );
         if ( !candidates.empty() )
         {
             unsigned index = Random(bc.getSeed()).next( candidates.size() );
@@ -138,14 +142,13 @@ Roof::resolveClutterModel(const Polygon* footprint, BuildContext& bc)
         // calculate a 4-point boundary suitable for placing rooftop models.
         _hasModelBox = findRectangle( footprint, _modelBox );
 
-        // encode the model box dimensions in the symbology so we can find
-        // suitable models that fit.
-        getModelSymbol()->maxSizeX() = (_modelBox[1]-_modelBox[0]).length();
-        getModelSymbol()->maxSizeY() = (_modelBox[2]-_modelBox[1]).length();
-        
-        // resolve the resource.
-        ModelResourceVector candidates;
-        bc.getResourceLibrary()->getModels( getModelSymbol(), candidates, bc.getDBOptions() );
+        // find suitable models that fit the model box.
+        const ModelResourceVector& candidates = bc.getResourceMemo()->getModels(
+            bc.getResourceLibrary(),
+            getModelSymbol(),
+            (_modelBox[1]-_modelBox[0]).length(),
+            (_modelBox[2]-_modelBox[1]).length(),
+            bc.getDBOptions() );
         if ( !candidates.empty() )
         {
             unsigned index = Random(bc.getSeed()).next( candidates.size() );
@@ -159,12 +162,9 @@ Roof::resolveInstancedModel(const Polygon* footprint, BuildContext& bc)
 {
     if ( getModelSymbol() && bc.getResourceLibrary() )
     {
-        //getModelSymbol()->addTags("instanced roof");
-        getModelSymbol()->addTags("instanced");
-        
         // resolve the resource.
-        ModelResourceVector candidates;
-        bc.getResourceLibrary()->getModels( getModelSymbol(), candidates, bc.getDBOptions() );
+        const ModelResourceVector& candidates = bc.getResourceMemo()->getModels(
+            bc.getResourceLibrary(), getModelSymbol(), "instanced", bc.getDBOptions() );
         if ( !candidates.empty() )
         {
             unsigned index = Random(bc.getSeed()).next( candidates.size() );
@@ -0,0 +1,457 @@
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "RoofTessellator"
+#include <osgEarth/Notify>
+#include <osg/Math>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+using namespace osgEarth;
+using namespace osgEarth::Buildings;
+
+#define LC "[RoofTessellator] "
+
+namespace
+{
+    // Twice the signed area of triangle (a, b, c) in the XY plane;
+    // positive when the triangle winds counter-clockwise.
+    inline double cross(const osg::Vec3f& a, const osg::Vec3f& b, const osg::Vec3f& c)
+    {
+        return
+            ((double)b.x()-(double)a.x()) * ((double)c.y()-(double)a.y()) -
+            ((double)b.y()-(double)a.y()) * ((double)c.x()-(double)a.x());
+    }
+
+    // Twice the signed area of a ring in the XY plane.
+    inline double ringArea(const std::vector<osg::Vec3f>& verts, unsigned offset, unsigned size)
+    {
+        double area = 0.0;
+        for(unsigned i=0, j=size-1; i<size; j=i++)
+        {
+            const osg::Vec3f& a = verts[offset+j];
+            const osg::Vec3f& b = verts[offset+i];
+            area += (double)a.x()*(double)b.y() - (double)b.x()*(double)a.y();
+        }
+        return area;
+    }
+
+    inline bool sameXY(const osg::Vec3f& a, const osg::Vec3f& b)
+    {
+        return a.x() == b.x() && a.y() == b.y();
+    }
+
+    // Whether p lies inside or on the triangle (a, b, c), regardless of winding.
+    inline bool inTriangle(const osg::Vec3f& a, const osg::Vec3f& b, const osg::Vec3f& c, const osg::Vec3f& p)
+    {
+        double d1 = cross(a, b, p);
+        double d2 = cross(b, c, p);
+        double d3 = cross(c, a, p);
+        bool hasNeg = d1 < 0.0 || d2 < 0.0 || d3 < 0.0;
+        bool hasPos = d1 > 0.0 || d2 > 0.0 || d3 > 0.0;
+        return !(hasNeg && hasPos);
+    }
+}
+
+RoofTessellator::RoofTessellator() :
+_ringStart( 0u )
+{
+    for(unsigned i=0; i<NUM_PATHS; ++i)
+        _counts[i] = 0u;
+}
+
+void
+RoofTessellator::begin()
+{
+    _verts.clear();
+    _texCoords.clear();
+    _ringSizes.clear();
+    _ringStart = 0u;
+}
+
+void
+RoofTessellator::endRing()
+{
+    // drop an explicit closing vertex; rings are implicitly closed.
+    unsigned size = _verts.size() - _ringStart;
+    if ( size > 1 && _verts.back() == _verts[_ringStart] )
+    {
+        _verts.pop_back();
+        _texCoords.pop_back();
+        --size;
+    }
+
+    if ( size > 0 )
+    {
+        _ringSizes.push_back( size );
+    }
+
+    _ringStart = _verts.size();
+}
+
+RoofTessellator::Path
+RoofTessellator::tessellate()
+{
+    std::vector<unsigned>& triangles = _triangles;
+    triangles.clear();
+    Path path = PATH_FALLBACK;
+
+    if ( _ringSizes.empty() || _ringSizes[0] < 3 )
+    {
+        ++_counts[path];
+        return path;
+    }
+
+    // Outer ring, wound counter-clockwise.
+    unsigned outerSize = _ringSizes[0];
+    double area = ringArea(_verts, 0, outerSize);
+    if ( area == 0.0 )
+    {
+        ++_counts[path];
+        return path;
+    }
+
+    _poly.clear();
+    for(unsigned i=0; i<outerSize; ++i)
+        _poly.push_back( area > 0.0 ? i : outerSize-1-i );
+
+    // Gather holes, ignoring anything too small to enclose an area.
+    _holes.clear();
+    unsigned offset = outerSize;
+    for(unsigned r=1; r<_ringSizes.size(); ++r)
+    {
+        unsigned size = _ringSizes[r];
+        if ( size >= 3 )
+        {
+            float maxX = -FLT_MAX;
+            for(unsigned i=offset; i<offset+size; ++i)
+                maxX = std::max(maxX, _verts[i].x());
+
+            // negate so that sorting visits the rightmost hole first.
+            _holes.push_back( std::make_pair(-maxX, r) );
+        }
+        offset += size;
+    }
+
+    // Fast paths for the common footprints.
+    if ( _holes.empty() )
+    {
+        bool isRectangle = false;
+
+        if ( outerSize == 3 )
+        {
+            triangles.insert( triangles.end(), _poly.begin(), _poly.end() );
+            path = PATH_TRIANGLE;
+        }
+
+        else if ( isConvex(_poly, isRectangle) )
+        {
+            for(unsigned i=1; i+1<outerSize; ++i)
+            {
+                triangles.push_back( _poly[0] );
+                triangles.push_back( _poly[i] );
+                triangles.push_back( _poly[i+1] );
+            }
+            path = isRectangle ? PATH_RECTANGLE : PATH_CONVEX;
+        }
+    }
+
+    // General case: splice the holes into the outline and clip ears.
+    if ( path == PATH_FALLBACK )
+    {
+        std::sort( _holes.begin(), _holes.end() );
+
+        // crossing edges are beyond us; leave them to the fallback.
+        bool ok = !hasCrossings();
+        for(unsigned h=0; h<_holes.size() && ok; ++h)
+        {
+            ok = bridgeHole( _holes[h].second );
+        }
+
+        if ( ok && earClip(triangles) )
+        {
+            path = PATH_EAR_CLIP;
+        }
+        else
+        {
+            OE_DEBUG << LC << "Ear clipping failed; caller will fall back\n";
+            triangles.clear();
+        }
+    }
+
+    ++_counts[path];
+    return path;
+}
+
+bool
+RoofTessellator::isConvex(const std::vector<unsigned>& poly, bool& isRectangle) const
+{
+    unsigned n = poly.size();
+    isRectangle = (n == 4);
+
+    // Every corner must turn left, and the turns must add up to exactly one
+    // revolution (this rejects self-intersecting "stars").
+    double totalTurn = 0.0;
+
+    for(unsigned i=0; i<n; ++i)
+    {
+        const osg::Vec3f& a = _verts[poly[(i+n-1)%n]];
+        const osg::Vec3f& b = _verts[poly[i]];
+        const osg::Vec3f& c = _verts[poly[(i+1)%n]];
+
+        double e1x = (double)b.x()-(double)a.x(), e1y = (double)b.y()-(double)a.y();
+        double e2x = (double)c.x()-(double)b.x(), e2y = (double)c.y()-(double)b.y();
+
+        double len = sqrt(e1x*e1x + e1y*e1y) * sqrt(e2x*e2x + e2y*e2y);
+        if ( len == 0.0 )
+            return false;
+
+        double crs = e1x*e2y - e1y*e2x;
+        double dot = e1x*e2x + e1y*e2y;
+
+        if ( crs < -1e-6*len )
+            return false;
+
+        if ( isRectangle && fabs(dot) > 1e-3*len )
+            isRectangle = false;
+
+        totalTurn += atan2(crs, dot);
+    }
+
+    return fabs(totalTurn - 2.0*osg::PI) < 1e-3;
+}
+
+bool
+RoofTessellator::hasCrossings() const
+{
+    // Brute-force test for edges (from any rings) that properly cross
+    // each other. Footprints are small so this is cheap next to clipping.
+    unsigned total = _verts.size();
+    unsigned ringA = 0u, offsetA = 0u;
+    for(unsigned i=0; i<total; ++i)
+    {
+        if ( i == offsetA + _ringSizes[ringA] )
+            offsetA += _ringSizes[ringA++];
+        const osg::Vec3f& a0 = _verts[i];
+        const osg::Vec3f& a1 = _verts[i+1 < offsetA + _ringSizes[ringA] ? i+1 : offsetA];
+
+        unsigned ringB = ringA, offsetB = offsetA;
+        for(unsigned j=i+1; j<total; ++j)
+        {
+            if ( j == offsetB + _ringSizes[ringB] )
+                offsetB += _ringSizes[ringB++];
+            const osg::Vec3f& b0 = _verts[j];
+            const osg::Vec3f& b1 = _verts[j+1 < offsetB + _ringSizes[ringB] ? j+1 : offsetB];
+
+            double d1 = cross(a0, a1, b0), d2 = cross(a0, a1, b1);
+            double d3 = cross(b0, b1, a0), d4 = cross(b0, b1, a1);
+            if ( ((d1 > 0.0 && d2 < 0.0) || (d1 < 0.0 && d2 > 0.0)) &&
+                 ((d3 > 0.0 && d4 < 0.0) || (d3 < 0.0 && d4 > 0.0)) )
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool
+RoofTessellator::bridgeHole(unsigned ring)
+{
+    unsigned offset = 0u;
+    for(unsigned r=0; r<ring; ++r)
+        offset += _ringSizes[r];
+    unsigned size = _ringSizes[ring];
+
+    // holes must wind clockwise.
+    double area = ringArea(_verts, offset, size);
+    if ( area == 0.0 )
+        return true;
+    bool reverse = area > 0.0;
+
+    // start from the hole's rightmost vertex, M.
+    unsigned mk = 0u;
+    for(unsigned k=1; k<size; ++k)
+        if ( _verts[offset+k].x() > _verts[offset+mk].x() )
+            mk = k;
+    unsigned M = offset + mk;
+    const osg::Vec3f& m = _verts[M];
+
+    // Cast a ray from M in +X and find the closest edge it hits. On a CCW
+    // outline, the edges that face the hole run upwards.
+    unsigned n = _poly.size();
+    double   bestX = DBL_MAX;
+    unsigned bestEdge = n;
+    for(unsigned i=0; i<n; ++i)
+    {
+        const osg::Vec3f& a = _verts[_poly[i]];
+        const osg::Vec3f& b = _verts[_poly[(i+1)%n]];
+        if ( a.y() <= m.y() && b.y() >= m.y() && a.y() != b.y() )
+        {
+            double x = (double)a.x() + ((double)m.y()-(double)a.y()) * ((double)b.x()-(double)a.x()) / ((double)b.y()-(double)a.y());
+            if ( x >= (double)m.x() && x < bestX )
+            {
+                bestX = x;
+                bestEdge = i;
+            }
+        }
+    }
+
+    if ( bestEdge == n )
+        return false;
+
+    // Candidate bridge vertex P is the edge endpoint farthest along the ray.
+    unsigned pi = bestEdge;
+    if ( _verts[_poly[(bestEdge+1)%n]].x() > _verts[_poly[bestEdge]].x() )
+        pi = (bestEdge+1)%n;
+
+    // If any reflex vertex lies inside the triangle (M, I, P), P might not be
+    // visible from M; use the reflex vertex closest in angle to the ray instead.
+    osg::Vec3f I( (float)bestX, m.y(), m.z() );
+    osg::Vec3f P = _verts[_poly[pi]];
+    double bestTan = DBL_MAX;
+    double bestDist = DBL_MAX;
+    for(unsigned j=0; j<n; ++j)
+    {
+        if ( j == pi )
+            continue;
+
+        const osg::Vec3f& v = _verts[_poly[j]];
+        if ( sameXY(v, P) || v.x() < m.x() || !inTriangle(m, I, P, v) )
+            continue;
+
+        const osg::Vec3f& prev = _verts[_poly[(j+n-1)%n]];
+        const osg::Vec3f& next = _verts[_poly[(j+1)%n]];
+        if ( cross(prev, v, next) > 0.0 )
+            continue;
+
+        double dx = (double)v.x() - (double)m.x();
+        double t  = dx > 0.0 ? fabs((double)v.y() - (double)m.y()) / dx : DBL_MAX;
+        if ( t < bestTan || (t == bestTan && dx < bestDist) )
+        {
+            bestTan = t;
+            bestDist = dx;
+            pi = j;
+        }
+    }
+
+    // Splice: ... P, M, (hole), M, P, ...
+    _merged.clear();
+    for(unsigned j=0; j<=pi; ++j)
+        _merged.push_back( _poly[j] );
+    for(unsigned k=0; k<size; ++k)
+        _merged.push_back( offset + (reverse ? (mk+size-k)%size : (mk+k)%size) );
+    _merged.push_back( M );
+    _merged.push_back( _poly[pi] );
+    for(unsigned j=pi+1; j<n; ++j)
+        _merged.push_back( _poly[j] );
+
+    _poly.swap( _merged );
+    return true;
+}
+
+bool
+RoofTessellator::earClip(std::vector<unsigned>& triangles)
+{
+    unsigned n = _poly.size();
+    if ( n < 3 )
+        return false;
+
+    // doubly-linked list of positions in _poly.
+    _prev.resize( n );
+    _next.resize( n );
+    for(unsigned i=0; i<n; ++i)
+    {
+        _prev[i] = (i+n-1)%n;
+        _next[i] = (i+1)%n;
+    }
+
+    unsigned remaining = n;
+    unsigned i = 0u;
+    unsigned stall = 0u;
+
+    while( remaining > 3 )
+    {
+        unsigned p  = _prev[i];
+        unsigned nx = _next[i];
+
+        const osg::Vec3f& a = _verts[_poly[p]];
+        const osg::Vec3f& b = _verts[_poly[i]];
+        const osg::Vec3f& c = _verts[_poly[nx]];
+
+        bool isEar = cross(a, b, c) > 0.0;
+
+        // an ear may not contain any other vertex (duplicates from the
+        // hole bridges are allowed to touch it).
+        for(unsigned j=_next[nx]; isEar && j != p; j=_next[j])
+        {
+            const osg::Vec3f& v = _verts[_poly[j]];
+            if ( !sameXY(v, a) && !sameXY(v, b) && !sameXY(v, c) && inTriangle(a, b, c, v) )
+                isEar = false;
+        }
+
+        if ( isEar )
+        {
+            triangles.push_back( _poly[p] );
+            triangles.push_back( _poly[i] );
+            triangles.push_back( _poly[nx] );
+            _next[p] = nx;
+            _prev[nx] = p;
+            --remaining;
+            i = nx;
+            stall = 0u;
+            continue;
+        }
+
+        i = nx;
+
+        if ( ++stall >= remaining )
+        {
+            // No ears left. Collinear or repeated vertices can cause this;
+            // drop one and carry on. Otherwise the input is bad.
+            bool dropped = false;
+            unsigned k = i;
+            for(unsigned count=0; count<remaining && !dropped; ++count, k=_next[k])
+            {
+                const osg::Vec3f& ka = _verts[_poly[_prev[k]]];
+                const osg::Vec3f& kb = _verts[_poly[k]];
+                const osg::Vec3f& kc = _verts[_poly[_next[k]]];
+                double scale = (kb-ka).length2() + (kc-kb).length2();
+                if ( fabs(cross(ka, kb, kc)) <= 1e-9*scale )
+                {
+                    _next[_prev[k]] = _next[k];
+                    _prev[_next[k]] = _prev[k];
+                    i = _next[k];
+                    --remaining;
+                    dropped = true;
+                }
+            }
+
+            if ( !dropped )
+                return false;
+
+            stall = 0u;
+        }
+    }
+
+    triangles.push_back( _poly[_prev[i]] );
+    triangles.push_back( _poly[i] );
+    triangles.push_back( _poly[_next[i]] );
+
+    return true;
+}
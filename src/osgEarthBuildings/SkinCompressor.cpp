@@ -0,0 +1,482 @@
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "SkinCompressor"
+#include <osgEarth/ImageUtils>
+#include <osg/Texture>
+#include <osgDB/FileNameUtils>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+using namespace osgEarth;
+using namespace osgEarth::Buildings;
+
+#define LC "[SkinCompressor] "
+
+// Bytes in one 4x4 BC1 block
+#define BLOCK_BYTES 8u
+
+namespace
+{
+    unsigned floorPowerOfTwo(unsigned n)
+    {
+        unsigned p = 1u;
+        while ( (p << 1) <= n )
+            p <<= 1;
+        return p;
+    }
+
+    // the closer of the powers of two on either side of n, so that a size
+    // just short of one (like 1000) doesn't lose half its resolution.
+    unsigned nearestPowerOfTwo(unsigned n)
+    {
+        unsigned p = floorPowerOfTwo(n);
+        return n - p > (p << 1) - n ? p << 1 : p;
+    }
+
+    unsigned numBlocks(unsigned n)
+    {
+        return std::max(1u, (n + 3u) / 4u);
+    }
+
+    unsigned short packRGB565(const float* c)
+    {
+        unsigned r = (unsigned)(osg::clampBetween(c[0], 0.0f, 255.0f) * 31.0f / 255.0f + 0.5f);
+        unsigned g = (unsigned)(osg::clampBetween(c[1], 0.0f, 255.0f) * 63.0f / 255.0f + 0.5f);
+        unsigned b = (unsigned)(osg::clampBetween(c[2], 0.0f, 255.0f) * 31.0f / 255.0f + 0.5f);
+        return (unsigned short)((r << 11) | (g << 5) | b);
+    }
+
+    void unpackRGB565(unsigned short v, float* c)
+    {
+        unsigned r = (v >> 11) & 0x1f, g = (v >> 5) & 0x3f, b = v & 0x1f;
+        c[0] = (float)((r << 3) | (r >> 2));
+        c[1] = (float)((g << 2) | (g >> 4));
+        c[2] = (float)((b << 3) | (b >> 2));
+    }
+
+    /**
+     * The four colors a BC1 block can reproduce in opaque mode. When the
+     * endpoints are equal the block is in three-color mode, but color 0 is
+     * the endpoint either way and it is the only one used then.
+     */
+    void makePalette(unsigned short c0, unsigned short c1, float palette[4][3])
+    {
+        unpackRGB565(c0, palette[0]);
+        unpackRGB565(c1, palette[1]);
+        for(unsigned i=0; i<3; ++i)
+        {
+            if ( c0 > c1 )
+            {
+                palette[2][i] = (2.0f*palette[0][i] + palette[1][i]) / 3.0f;
+                palette[3][i] = (palette[0][i] + 2.0f*palette[1][i]) / 3.0f;
+            }
+            else
+            {
+                palette[2][i] = 0.5f*(palette[0][i] + palette[1][i]);
+                palette[3][i] = 0.0f;
+            }
+        }
+    }
+
+    float distance2(const float* a, const float* b)
+    {
+        float dr = a[0]-b[0], dg = a[1]-b[1], db = a[2]-b[2];
+        return dr*dr + dg*dg + db*db;
+    }
+
+    /** Picks the closest palette color for each pixel; returns the total squared error. */
+    float assignIndices(const float pixels[16][3], unsigned short c0, unsigned short c1, unsigned char* indices)
+    {
+        float palette[4][3];
+        makePalette(c0, c1, palette);
+        unsigned numColors = c0 > c1 ? 4u : 1u;
+
+        float error = 0.0f;
+        for(unsigned p=0; p<16; ++p)
+        {
+            unsigned best = 0;
+            float bestDist = distance2(pixels[p], palette[0]);
+            for(unsigned i=1; i<numColors; ++i)
+            {
+                float d = distance2(pixels[p], palette[i]);
+                if ( d < bestDist ) { best = i; bestDist = d; }
+            }
+            indices[p] = (unsigned char)best;
+            error += bestDist;
+        }
+        return error;
+    }
+
+    /** Orders the endpoints for four-color mode, remapping the indices to match. */
+    void makeOpaque(unsigned short& c0, unsigned short& c1, unsigned char* indices)
+    {
+        if ( c0 < c1 )
+        {
+            std::swap(c0, c1);
+            static const unsigned char swapped[4] = { 1, 0, 3, 2 };
+            for(unsigned p=0; p<16; ++p)
+                indices[p] = swapped[indices[p]];
+        }
+    }
+
+    /**
+     * Least-squares fit of the two endpoints to the pixels, given the
+     * palette entry each pixel was assigned to. Returns false when the
+     * system is degenerate (all pixels on one entry).
+     */
+    bool refitEndpoints(const float pixels[16][3], const unsigned char* indices, float* e0, float* e1)
+    {
+        static const float weight[4] = { 1.0f, 0.0f, 2.0f/3.0f, 1.0f/3.0f };
+
+        float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+        float ax[3] = { 0,0,0 }, bx[3] = { 0,0,0 };
+        for(unsigned p=0; p<16; ++p)
+        {
+            float a = weight[indices[p]], b = 1.0f - a;
+            aa += a*a; ab += a*b; bb += b*b;
+            for(unsigned i=0; i<3; ++i)
+            {
+                ax[i] += a*pixels[p][i];
+                bx[i] += b*pixels[p][i];
+            }
+        }
+
+        float det = aa*bb - ab*ab;
+        if ( fabs(det) < 1e-6f )
+            return false;
+
+        for(unsigned i=0; i<3; ++i)
+        {
+            e0[i] = (bb*ax[i] - ab*bx[i]) / det;
+            e1[i] = (aa*bx[i] - ab*ax[i]) / det;
+        }
+        return true;
+    }
+
+    /**
+     * Encodes one 4x4 block. The endpoints start at the extremes of the
+     * pixels along their principal axis, then get one least-squares refit.
+     */
+    void encodeBlock(const float pixels[16][3], unsigned char* out)
+    {
+        float mean[3] = { 0,0,0 };
+        for(unsigned p=0; p<16; ++p)
+            for(unsigned i=0; i<3; ++i)
+                mean[i] += pixels[p][i] / 16.0f;
+
+        float cov[6] = { 0,0,0,0,0,0 }; // rr rg rb gg gb bb
+        for(unsigned p=0; p<16; ++p)
+        {
+            float r = pixels[p][0]-mean[0], g = pixels[p][1]-mean[1], b = pixels[p][2]-mean[2];
+            cov[0] += r*r; cov[1] += r*g; cov[2] += r*b;
+            cov[3] += g*g; cov[4] += g*b; cov[5] += b*b;
+        }
+
+        // principal axis by power iteration:
+        float axis[3] = { 1.0f, 1.0f, 1.0f };
+        for(unsigned k=0; k<8; ++k)
+        {
+            float x = cov[0]*axis[0] + cov[1]*axis[1] + cov[2]*axis[2];
+            float y = cov[1]*axis[0] + cov[3]*axis[1] + cov[4]*axis[2];
+            float z = cov[2]*axis[0] + cov[4]*axis[1] + cov[5]*axis[2];
+            float len = std::max(fabs(x), std::max(fabs(y), fabs(z)));
+            if ( len < 1e-6f )
+                break;
+            axis[0] = x/len; axis[1] = y/len; axis[2] = z/len;
+        }
+
+        float minProj = std::numeric_limits<float>::max();
+        float maxProj = -std::numeric_limits<float>::max();
+        unsigned minP = 0, maxP = 0;
+        for(unsigned p=0; p<16; ++p)
+        {
+            float d =
+                (pixels[p][0]-mean[0])*axis[0] +
+                (pixels[p][1]-mean[1])*axis[1] +
+                (pixels[p][2]-mean[2])*axis[2];
+            if ( d < minProj ) { minProj = d; minP = p; }
+            if ( d > maxProj ) { maxProj = d; maxP = p; }
+        }
+
+        unsigned short c0 = packRGB565(pixels[maxP]);
+        unsigned short c1 = packRGB565(pixels[minP]);
+        unsigned char indices[16];
+
+        if ( c0 == c1 )
+        {
+            ::memset(indices, 0, 16);
+        }
+        else
+        {
+            if ( c0 < c1 )
+                std::swap(c0, c1);
+            float error = assignIndices(pixels, c0, c1, indices);
+
+            float e0[3], e1[3];
+            if ( refitEndpoints(pixels, indices, e0, e1) )
+            {
+                unsigned short r0 = packRGB565(e0);
+                unsigned short r1 = packRGB565(e1);
+                if ( r0 != r1 )
+                {
+                    unsigned char refit[16];
+                    if ( r0 < r1 )
+                        std::swap(r0, r1);
+                    if ( assignIndices(pixels, r0, r1, refit) < error )
+                    {
+                        c0 = r0;
+                        c1 = r1;
+                        ::memcpy(indices, refit, 16);
+                    }
+                }
+            }
+            makeOpaque(c0, c1, indices);
+        }
+
+        out[0] = (unsigned char)(c0 & 0xff);
+        out[1] = (unsigned char)(c0 >> 8);
+        out[2] = (unsigned char)(c1 & 0xff);
+        out[3] = (unsigned char)(c1 >> 8);
+        for(unsigned row=0; row<4; ++row)
+        {
+            out[4+row] = (unsigned char)(
+                (indices[row*4+0]     ) |
+                (indices[row*4+1] << 2) |
+                (indices[row*4+2] << 4) |
+                (indices[row*4+3] << 6) );
+        }
+    }
+
+    /** Encodes a tightly packed RGBA8 level; edge blocks repeat the last row/column. */
+    void encodeLevel(const unsigned char* rgba, unsigned w, unsigned h, unsigned char* out)
+    {
+        float pixels[16][3];
+        for(unsigned by=0; by<numBlocks(h); ++by)
+        {
+            for(unsigned bx=0; bx<numBlocks(w); ++bx)
+            {
+                for(unsigned y=0; y<4; ++y)
+                {
+                    unsigned t = std::min(by*4u + y, h-1u);
+                    for(unsigned x=0; x<4; ++x)
+                    {
+                        unsigned s = std::min(bx*4u + x, w-1u);
+                        const unsigned char* p = rgba + (t*w + s)*4u;
+                        pixels[y*4+x][0] = p[0];
+                        pixels[y*4+x][1] = p[1];
+                        pixels[y*4+x][2] = p[2];
+                    }
+                }
+                encodeBlock(pixels, out);
+                out += BLOCK_BYTES;
+            }
+        }
+    }
+
+    /** Box-filters a tightly packed RGBA8 level down to half size. */
+    void downsample(const std::vector<unsigned char>& src, unsigned w, unsigned h, std::vector<unsigned char>& dst)
+    {
+        unsigned dw = std::max(1u, w/2u), dh = std::max(1u, h/2u);
+        dst.resize(dw*dh*4u);
+        for(unsigned t=0; t<dh; ++t)
+        {
+            unsigned t0 = std::min(2u*t, h-1u), t1 = std::min(2u*t+1u, h-1u);
+            for(unsigned s=0; s<dw; ++s)
+            {
+                unsigned s0 = std::min(2u*s, w-1u), s1 = std::min(2u*s+1u, w-1u);
+                for(unsigned c=0; c<4; ++c)
+                {
+                    unsigned sum =
+                        (unsigned)src[(t0*w + s0)*4u + c] + src[(t0*w + s1)*4u + c] +
+                        (unsigned)src[(t1*w + s0)*4u + c] + src[(t1*w + s1)*4u + c];
+                    dst[(t*dw + s)*4u + c] = (unsigned char)((sum + 2u) >> 2);
+                }
+            }
+        }
+    }
+
+    /** Copies an RGBA8 image into a tightly packed buffer. */
+    void readPixels(const osg::Image* image, std::vector<unsigned char>& out)
+    {
+        unsigned w = image->s(), h = image->t();
+        out.resize(w*h*4u);
+        for(unsigned t=0; t<h; ++t)
+            ::memcpy(&out[t*w*4u], image->data(0, t), w*4u);
+    }
+}
+
+osg::Image*
+SkinCompressor::compress(const osg::Image* image, unsigned maxSize)
+{
+    if ( !image || image->s() < 1 || image->t() < 1 || image->isCompressed() )
+        return 0L;
+
+    if ( ImageUtils::hasTransparency(image) )
+    {
+        OE_INFO << LC << image->getFileName() << " has transparency; not compressing\n";
+        return 0L;
+    }
+
+    osg::ref_ptr<osg::Image> rgba = ImageUtils::convertToRGBA8(image);
+    if ( !rgba.valid() )
+        return 0L;
+
+    // conform to a power of two so the mipmap chain halves evenly:
+    unsigned w = nearestPowerOfTwo(rgba->s());
+    unsigned h = nearestPowerOfTwo(rgba->t());
+    if ( maxSize > 0u )
+    {
+        w = std::min(w, floorPowerOfTwo(maxSize));
+        h = std::min(h, floorPowerOfTwo(maxSize));
+    }
+
+    if ( w != (unsigned)rgba->s() || h != (unsigned)rgba->t() )
+    {
+        osg::ref_ptr<osg::Image> resized;
+        if ( !ImageUtils::resizeImage(rgba.get(), w, h, resized) )
+            return 0L;
+        rgba = resized.get();
+    }
+
+    // total size of all levels:
+    unsigned totalBytes = 0u;
+    for(unsigned lw = w, lh = h; ; lw = std::max(1u, lw/2u), lh = std::max(1u, lh/2u))
+    {
+        totalBytes += numBlocks(lw) * numBlocks(lh) * BLOCK_BYTES;
+        if ( lw == 1u && lh == 1u )
+            break;
+    }
+
+    unsigned char* data = new unsigned char[totalBytes];
+    osg::Image::MipmapDataType offsets;
+
+    std::vector<unsigned char> level, next;
+    readPixels( rgba.get(), level );
+
+    unsigned offset = 0u;
+    for(unsigned lw = w, lh = h; ; )
+    {
+        if ( offset > 0u )
+            offsets.push_back( offset );
+
+        encodeLevel( &level[0], lw, lh, data + offset );
+        offset += numBlocks(lw) * numBlocks(lh) * BLOCK_BYTES;
+
+        if ( lw == 1u && lh == 1u )
+            break;
+
+        downsample( level, lw, lh, next );
+        level.swap( next );
+        lw = std::max(1u, lw/2u);
+        lh = std::max(1u, lh/2u);
+    }
+
+    osg::Image* result = new osg::Image();
+    result->setImage(
+        w, h, 1,
+        GL_COMPRESSED_RGB_S3TC_DXT1_EXT, GL_COMPRESSED_RGB_S3TC_DXT1_EXT, GL_UNSIGNED_BYTE,
+        data,
+        osg::Image::USE_NEW_DELETE);
+    result->setMipmapLevels( offsets );
+    result->setOrigin( image->getOrigin() );
+    result->setFileName( getCompressedFileName(image->getFileName()) );
+    return result;
+}
+
+osg::Image*
+SkinCompressor::decompress(const osg::Image* image)
+{
+    if ( !image || image->getPixelFormat() != GL_COMPRESSED_RGB_S3TC_DXT1_EXT )
+        return 0L;
+
+    unsigned w = image->s(), h = image->t();
+
+    osg::Image* result = new osg::Image();
+    result->allocateImage(w, h, 1, GL_RGBA, GL_UNSIGNED_BYTE);
+    result->setInternalTextureFormat(GL_RGBA8);
+    result->setOrigin( image->getOrigin() );
+
+    const unsigned char* block = image->data();
+    for(unsigned by=0; by<numBlocks(h); ++by)
+    {
+        for(unsigned bx=0; bx<numBlocks(w); ++bx, block += BLOCK_BYTES)
+        {
+            unsigned short c0 = (unsigned short)(block[0] | (block[1] << 8));
+            unsigned short c1 = (unsigned short)(block[2] | (block[3] << 8));
+            float palette[4][3];
+            makePalette(c0, c1, palette);
+
+            for(unsigned y=0; y<4 && by*4u+y < h; ++y)
+            {
+                for(unsigned x=0; x<4 && bx*4u+x < w; ++x)
+                {
+                    unsigned index = (block[4+y] >> (2*x)) & 0x3;
+                    unsigned char* p = result->data(bx*4u+x, by*4u+y);
+                    p[0] = (unsigned char)(palette[index][0] + 0.5f);
+                    p[1] = (unsigned char)(palette[index][1] + 0.5f);
+                    p[2] = (unsigned char)(palette[index][2] + 0.5f);
+                    p[3] = (c0 <= c1 && index == 3) ? 0 : 255;
+                }
+            }
+        }
+    }
+
+    return result;
+}
+
+double
+SkinCompressor::psnr(const osg::Image* a, const osg::Image* b)
+{
+    if ( !a || !b || a->s() != b->s() || a->t() != b->t() )
+        return 0.0;
+
+    osg::ref_ptr<osg::Image> ra = ImageUtils::convertToRGBA8(a);
+    osg::ref_ptr<osg::Image> rb = ImageUtils::convertToRGBA8(b);
+    if ( !ra.valid() || !rb.valid() )
+        return 0.0;
+
+    double sum = 0.0;
+    for(int t=0; t<ra->t(); ++t)
+    {
+        for(int s=0; s<ra->s(); ++s)
+        {
+            const unsigned char* pa = ra->data(s, t);
+            const unsigned char* pb = rb->data(s, t);
+            for(unsigned c=0; c<3; ++c)
+            {
+                double d = (double)pa[c] - (double)pb[c];
+                sum += d*d;
+            }
+        }
+    }
+
+    double mse = sum / (3.0 * ra->s() * ra->t());
+    if ( mse <= 0.0 )
+        return std::numeric_limits<double>::infinity();
+
+    return 10.0 * log10(255.0*255.0 / mse);
+}
+
+std::string
+SkinCompressor::getCompressedFileName(const std::string& fileName)
+{
+    return osgDB::getNameLessExtension(fileName) + ".dds";
+}
@@ -0,0 +1,125 @@
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "TaskPool"
+
+using namespace osgEarth;
+using namespace osgEarth::Buildings;
+
+#define LC "[TaskPool] "
+
+TaskPool::TaskPool(unsigned numThreads) :
+_quit( false )
+{
+    for(unsigned i=0; i<numThreads; ++i)
+    {
+        Worker* thread = new Worker(this, i+1u);
+        _threads.push_back( thread );
+        thread->start();
+    }
+}
+
+TaskPool::~TaskPool()
+{
+    _mutex.lock();
+    _quit = true;
+    _hasWork.broadcast();
+    _mutex.unlock();
+
+    for(unsigned i=0; i<_threads.size(); ++i)
+    {
+        _threads[i]->join();
+        delete _threads[i];
+    }
+}
+
+void
+TaskPool::runEntry(const Entry& entry, unsigned worker)
+{
+    _mutex.unlock();
+    entry.task->run( worker );
+    _mutex.lock();
+
+    if ( --entry.batch->remaining == 0u )
+        _batchDone.broadcast();
+}
+
+void
+TaskPool::work(unsigned worker)
+{
+    _mutex.lock();
+    for(;;)
+    {
+        while( _queue.empty() && !_quit )
+            _hasWork.wait( &_mutex );
+
+        if ( _queue.empty() )
+            break;
+
+        Entry entry = _queue.front();
+        _queue.pop_front();
+        runEntry( entry, worker );
+    }
+    _mutex.unlock();
+}
+
+void
+TaskPool::run(const Tasks& tasks)
+{
+    if ( _threads.empty() )
+    {
+        for(unsigned i=0; i<tasks.size(); ++i)
+            tasks[i]->run( 0u );
+        return;
+    }
+
+    Batch batch;
+    batch.remaining = tasks.size();
+
+    _mutex.lock();
+
+    for(unsigned i=0; i<tasks.size(); ++i)
+    {
+        Entry entry;
+        entry.task  = tasks[i].get();
+        entry.batch = &batch;
+        _queue.push_back( entry );
+    }
+    _hasWork.broadcast();
+
+    // help out until this batch is done. Only take this batch's tasks, so
+    // that the tasks of other batches never see this thread as their worker 0.
+    while( batch.remaining > 0u )
+    {
+        std::deque<Entry>::iterator i = _queue.begin();
+        while( i != _queue.end() && i->batch != &batch )
+            ++i;
+
+        if ( i != _queue.end() )
+        {
+            Entry entry = *i;
+            _queue.erase( i );
+            runEntry( entry, 0u );
+        }
+        else
+        {
+            _batchDone.wait( &_mutex );
+        }
+    }
+
+    _mutex.unlock();
+}
@@ -0,0 +1,404 @@
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "TextureCache"
+#include "SkinCompressor"
+#include <osg/Texture2D>
+#include <osg/TextureBuffer>
+#include <osgDB/FileUtils>
+#include <osgEarth/ImageUtils>
+#include <algorithm>
+#include <cstring>
+
+using namespace osgEarth;
+using namespace osgEarth::Buildings;
+
+#define LC "[TextureCache] "
+
+// Textures used more recently than this (seconds) are never evicted.
+#define MIN_AGE 10.0
+
+namespace
+{
+    // FNV-1a
+    unsigned hashString(const std::string& s)
+    {
+        unsigned h = 2166136261u;
+        for(std::string::const_iterator c = s.begin(); c != s.end(); ++c)
+        {
+            h ^= (unsigned char)(*c);
+            h *= 16777619u;
+        }
+        return h;
+    }
+
+    double getImageBytes(const osg::Texture* tex)
+    {
+        double bytes = 0.0;
+        for(unsigned i=0; i<tex->getNumImages(); ++i)
+        {
+            const osg::Image* image = tex->getImage(i);
+            if ( image )
+                bytes += (double)image->getTotalSizeInBytesIncludingMipmaps();
+        }
+        return bytes;
+    }
+
+    osg::Texture* makeTexture(osg::Image* image)
+    {
+        osg::Texture2D* tex = new osg::Texture2D( image );
+        tex->setWrap( osg::Texture::WRAP_S, osg::Texture::REPEAT );
+        tex->setWrap( osg::Texture::WRAP_T, osg::Texture::REPEAT );
+        tex->setFilter( osg::Texture::MIN_FILTER, osg::Texture::LINEAR_MIPMAP_LINEAR );
+        tex->setFilter( osg::Texture::MAG_FILTER, osg::Texture::LINEAR );
+        tex->setUseHardwareMipMapGeneration( !image->isMipmap() );
+        tex->setResizeNonPowerOfTwoHint( false );
+        tex->setMaxAnisotropy( 4.0f );
+        return tex;
+    }
+
+    /**
+     * Returns a pre-mipmapped image whose top level fits within maxSize (0 =
+     * any size), made of the image's own mipmap levels from there down, or
+     * NULL if it has too few levels.
+     */
+    osg::Image* reduceCompressed(osg::Image* image, unsigned maxSize)
+    {
+        unsigned first = 0u;
+        if ( maxSize > 0u )
+        {
+            while ( (unsigned)std::max(image->s() >> first, image->t() >> first) > maxSize )
+                ++first;
+        }
+
+        if ( first == 0u )
+            return image;
+
+        if ( first >= image->getNumMipmapLevels() )
+            return 0L;
+
+        unsigned base  = image->getMipmapOffset(first);
+        unsigned bytes = image->getTotalSizeInBytesIncludingMipmaps() - base;
+
+        unsigned char* data = new unsigned char[bytes];
+        ::memcpy(data, image->data() + base, bytes);
+
+        osg::Image::MipmapDataType offsets;
+        for(unsigned level = first+1; level < image->getNumMipmapLevels(); ++level)
+            offsets.push_back( image->getMipmapOffset(level) - base );
+
+        osg::Image* result = new osg::Image();
+        result->setImage(
+            std::max(1, image->s() >> first), std::max(1, image->t() >> first), 1,
+            image->getInternalTextureFormat(), image->getPixelFormat(), image->getDataType(),
+            data,
+            osg::Image::USE_NEW_DELETE,
+            image->getPacking());
+        result->setMipmapLevels( offsets );
+        result->setOrigin( image->getOrigin() );
+        result->setFileName( image->getFileName() );
+        return result;
+    }
+
+    struct Candidate
+    {
+        unsigned           shard;
+        const std::string* name;   // interned in the shard
+        unsigned           size;
+        osg::Timer_t       lastUsed;
+        bool operator < (const Candidate& rhs) const { return lastUsed < rhs.lastUsed; }
+    };
+}
+
+TextureCache::TextureCache() :
+_maxBytes( 0.0 )
+{
+    //nop
+}
+
+TextureCache::Shard&
+TextureCache::getShard(const std::string& name, unsigned size)
+{
+    return _shards[(hashString(name) ^ (size * 2654435761u)) % NUM_SHARDS];
+}
+
+TextureCache::Key
+TextureCache::makeKey(Shard& shard, const std::string& name, unsigned size)
+{
+    // call with the shard locked; the URI is only copied the first time.
+    return Key( &(*shard.names.insert(name).first), size );
+}
+
+void
+TextureCache::lock(Shard& shard)
+{
+    if ( shard.mutex.trylock() != 0 )
+    {
+        shard.mutex.lock();
+        ++shard.contentions;
+    }
+}
+
+void
+TextureCache::add(Shard& shard, Entry& entry, osg::Texture* tex)
+{
+    entry.texture = tex;
+    entry.bytes   = tex ? getImageBytes(tex) : 0.0;
+    entry.loaded  = true;
+    shard.bytes  += entry.bytes;
+    ++shard.misses;
+}
+
+osg::Texture*
+TextureCache::createTexture(SkinResource* skin, const osgDB::Options* readOptions, unsigned maxSize, bool& compressed) const
+{
+    compressed = false;
+
+    // Prefer the pre-compressed counterpart; a tier uses its smaller mipmaps.
+    std::string fileName = SkinCompressor::getCompressedFileName( skin->imageURI()->full() );
+    if ( osgDB::fileExists(fileName) )
+    {
+        osg::ref_ptr<osg::Image> image = URI(fileName).getImage(readOptions);
+        if ( image.valid() )
+            image = reduceCompressed(image.get(), maxSize);
+
+        if ( image.valid() )
+        {
+            compressed = true;
+            return makeTexture(image.get());
+        }
+
+        OE_WARN << LC << "Failed to load " << fileName << " (size " << maxSize << "); using the original image\n";
+    }
+
+    if ( maxSize == 0u )
+        return skin->createTexture(readOptions);
+
+    osg::ref_ptr<osg::Image> image = skin->createImage(readOptions);
+    if ( !image.valid() )
+        return 0L;
+
+    unsigned size = (unsigned)std::max(image->s(), image->t());
+    if ( size > maxSize )
+    {
+        double scale = (double)maxSize / (double)size;
+        unsigned s = std::max(1u, (unsigned)(image->s() * scale + 0.5));
+        unsigned t = std::max(1u, (unsigned)(image->t() * scale + 0.5));
+
+        osg::ref_ptr<osg::Image> reduced;
+        if ( ImageUtils::resizeImage(image.get(), s, t, reduced) )
+        {
+            reduced->setFileName( image->getFileName() );
+            image = reduced.get();
+        }
+    }
+
+    return makeTexture(image.get());
+}
+
+osg::Texture*
+TextureCache::get(SkinResource* skin, const osgDB::Options* readOptions, unsigned maxSize)
+{
+    // Texture arrays from osgearth_buildings_atlas hold every skin at one
+    // size, so they do not come in tiers.
+    if ( skin->imageLayer().isSet() )
+        maxSize = 0u;
+
+    const std::string& name = skin->imageURI()->full();
+    Shard& shard = getShard(name, maxSize);
+
+    lock(shard);
+    Key key = makeKey(shard, name, maxSize);
+    Entries::iterator i = shard.entries.find(key);
+    if ( i != shard.entries.end() && i->second.loaded )
+    {
+        // a hit, or a remembered failure.
+        ++shard.hits;
+        i->second.lastUsed = osg::Timer::instance()->tick();
+        osg::Texture* result = i->second.texture.get();
+        shard.mutex.unlock();
+        return result;
+    }
+    shard.mutex.unlock();
+
+    // Load without the lock, so the other skins in this shard stay
+    // available; if two threads load the same one, the first one in wins.
+    osg::ref_ptr<osg::Texture> tex;
+    bool compressed = false;
+
+    // Skins packed by osgearth_buildings_atlas reference a serialized
+    // texture array (one layer per skin) instead of an image.
+    if ( skin->imageLayer().isSet() )
+    {
+        osg::ref_ptr<osg::Object> obj = skin->imageURI()->getObject(readOptions);
+        tex = dynamic_cast<osg::Texture*>(obj.get());
+    }
+
+    if ( !tex.valid() )
+    {
+        tex = createTexture(skin, readOptions, maxSize, compressed);
+    }
+
+    if ( !tex.valid() )
+    {
+        OE_WARN << LC << "Failed to load " << name << "; will not try again\n";
+    }
+
+    lock(shard);
+    Entry& entry = shard.entries[key];
+    if ( !entry.loaded )
+    {
+        add( shard, entry, tex.get() );
+        if ( compressed )
+            ++shard.compressed;
+    }
+    entry.lastUsed = osg::Timer::instance()->tick();
+
+    osg::Texture* result = entry.texture.get();
+    shard.mutex.unlock();
+    return result;
+}
+
+osg::Texture*
+TextureCache::getOrInsert(osg::Texture* tex)
+{
+    if (tex && 
+        tex->getNumImages() > 0 &&                      
+        tex->getImage(0) &&
+        !tex->getImage(0)->getFileName().empty() &&     // has a valid filename
+        dynamic_cast<osg::TextureBuffer*>(tex) == 0L)   // isn't an instance data texture
+    {
+        const std::string& name = tex->getImage(0)->getFileName();
+        Shard& shard = getShard(name, 0u);
+
+        lock(shard);
+        Key key = makeKey(shard, name, 0u);
+
+        Entry& entry = shard.entries[key];
+        if ( entry.texture.valid() )
+            ++shard.hits;
+        else
+            add( shard, entry, tex );
+        entry.lastUsed = osg::Timer::instance()->tick();
+
+        osg::Texture* result = entry.texture.get();
+        shard.mutex.unlock();
+        return result;
+    }
+
+    return tex;
+}
+
+bool
+TextureCache::isOverBudget() const
+{
+    if ( _maxBytes <= 0.0 )
+        return false;
+
+    double bytes = 0.0;
+    for(unsigned i=0; i<NUM_SHARDS; ++i)
+    {
+        _shards[i].mutex.lock();
+        bytes += _shards[i].bytes;
+        _shards[i].mutex.unlock();
+    }
+    return bytes > _maxBytes;
+}
+
+void
+TextureCache::prune()
+{
+    if ( _maxBytes <= 0.0 )
+        return;
+
+    osg::Timer_t now = osg::Timer::instance()->tick();
+
+    // gather the textures that only the cache references:
+    std::vector<Candidate> candidates;
+    double bytes = 0.0;
+    for(unsigned i=0; i<NUM_SHARDS; ++i)
+    {
+        Shard& shard = _shards[i];
+        shard.mutex.lock();
+        bytes += shard.bytes;
+        for(Entries::const_iterator e = shard.entries.begin(); e != shard.entries.end(); ++e)
+        {
+            if ( e->second.texture.valid() &&
+                 e->second.texture->referenceCount() == 1 &&
+                 osg::Timer::instance()->delta_s(e->second.lastUsed, now) > MIN_AGE )
+            {
+                Candidate c;
+                c.shard    = i;
+                c.name     = e->first.first;
+                c.size     = e->first.second;
+                c.lastUsed = e->second.lastUsed;
+                candidates.push_back( c );
+            }
+        }
+        shard.mutex.unlock();
+    }
+
+    if ( bytes <= _maxBytes )
+        return;
+
+    std::sort( candidates.begin(), candidates.end() );
+
+    for(std::vector<Candidate>::const_iterator c = candidates.begin(); c != candidates.end() && bytes > _maxBytes; ++c)
+    {
+        Shard& shard = _shards[c->shard];
+        shard.mutex.lock();
+
+        // check again; a tile may have taken it in the meantime.
+        Entries::iterator e = shard.entries.find( Key(c->name, c->size) );
+        if ( e != shard.entries.end() &&
+             e->second.texture.valid() &&
+             e->second.texture->referenceCount() == 1 &&
+             e->second.lastUsed == c->lastUsed )
+        {
+            bytes       -= e->second.bytes;
+            shard.bytes -= e->second.bytes;
+            ++shard.evictions;
+            shard.entries.erase( e );
+        }
+
+        shard.mutex.unlock();
+    }
+}
+
+TextureCache::Stats
+TextureCache::getStats() const
+{
+    Stats stats;
+    stats.entries = 0u;
+    stats.bytes = 0.0;
+    stats.hits = stats.misses = stats.evictions = stats.contentions = stats.compressed = 0u;
+
+    for(unsigned i=0; i<NUM_SHARDS; ++i)
+    {
+        const Shard& shard = _shards[i];
+        shard.mutex.lock();
+        stats.entries     += shard.entries.size();
+        stats.bytes       += shard.bytes;
+        stats.hits        += shard.hits;
+        stats.misses      += shard.misses;
+        stats.evictions   += shard.evictions;
+        stats.contentions += shard.contentions;
+        stats.compressed  += shard.compressed;
+        shard.mutex.unlock();
+    }
+    return stats;
+}
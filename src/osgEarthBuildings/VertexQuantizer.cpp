@@ -0,0 +1,175 @@
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2008-2016 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "VertexQuantizer"
+
+using namespace osgEarth;
+using namespace osgEarth::Buildings;
+
+#define LC "[VertexQuantizer] "
+
+namespace
+{
+    // largest magnitude we store in a 16-bit component
+    const float QMAX = 32767.0f;
+
+    inline short toShort(float v)
+    {
+        return (short)osg::clampBetween(osg::round(v), -QMAX, QMAX);
+    }
+
+    inline signed char toSByte(float v)
+    {
+        return (signed char)osg::clampBetween(osg::round(v*127.0f), -127.0f, 127.0f);
+    }
+
+    inline unsigned char toUByte(float v)
+    {
+        return (unsigned char)osg::clampBetween(osg::round(v*255.0f), 0.0f, 255.0f);
+    }
+}
+
+VertexQuantizer::VertexQuantizer() :
+_maxUV     ( 1.0f ),
+_bytesSaved( 0u )
+{
+    //nop
+}
+
+void
+VertexQuantizer::expandBy(const osg::Geometry* geom)
+{
+    const osg::Vec3Array* verts = dynamic_cast<const osg::Vec3Array*>(geom->getVertexArray());
+    if ( verts )
+    {
+        for(osg::Vec3Array::const_iterator v = verts->begin(); v != verts->end(); ++v)
+            _box.expandBy( *v );
+    }
+
+    const osg::Vec3Array* texCoords = dynamic_cast<const osg::Vec3Array*>(geom->getTexCoordArray(0));
+    if ( texCoords )
+    {
+        for(osg::Vec3Array::const_iterator t = texCoords->begin(); t != texCoords->end(); ++t)
+            _maxUV = std::max(_maxUV, std::max(fabs(t->x()), fabs(t->y())));
+    }
+}
+
+float
+VertexQuantizer::getPositionScale() const
+{
+    // a uniform scale, so that the normal matrix stays orthogonal
+    float halfExtent = 0.5f * std::max(_box.xMax()-_box.xMin(), std::max(_box.yMax()-_box.yMin(), _box.zMax()-_box.zMin()));
+    return std::max(halfExtent, 0.001f) / QMAX;
+}
+
+float
+VertexQuantizer::getTexCoordScale() const
+{
+    return _maxUV / QMAX;
+}
+
+osg::Matrix
+VertexQuantizer::getDecodeMatrix() const
+{
+    float s = getPositionScale();
+    return osg::Matrix::scale(s, s, s) * osg::Matrix::translate(_box.center());
+}
+
+bool
+VertexQuantizer::quantize(osg::Geometry* geom)
+{
+    osg::Vec3Array* verts = dynamic_cast<osg::Vec3Array*>(geom->getVertexArray());
+    if ( !verts || !_box.valid() )
+        return false;
+
+    unsigned bytesBefore = 0u, bytesAfter = 0u;
+
+    // positions
+    const osg::Vec3f center = _box.center();
+    const float invScale = 1.0f / getPositionScale();
+
+    osg::Vec3sArray* qverts = new osg::Vec3sArray();
+    qverts->reserve( verts->size() );
+    osg::BoundingBox qbox;
+    for(osg::Vec3Array::const_iterator v = verts->begin(); v != verts->end(); ++v)
+    {
+        osg::Vec3f p = ((*v) - center) * invScale;
+        osg::Vec3s q( toShort(p.x()), toShort(p.y()), toShort(p.z()) );
+        qverts->push_back( q );
+        qbox.expandBy( osg::Vec3f(q.x(), q.y(), q.z()) );
+    }
+    bytesBefore += verts->getTotalDataSize();
+    bytesAfter  += qverts->getTotalDataSize();
+    geom->setVertexArray( qverts );
+
+    // OSG cannot compute bounds from a short array, so provide them.
+    geom->setInitialBound( qbox );
+
+    // normals
+    osg::Vec3Array* normals = dynamic_cast<osg::Vec3Array*>(geom->getNormalArray());
+    if ( normals && geom->getNormalBinding() == geom->BIND_PER_VERTEX )
+    {
+        osg::Vec3bArray* qnormals = new osg::Vec3bArray();
+        qnormals->reserve( normals->size() );
+        for(osg::Vec3Array::const_iterator n = normals->begin(); n != normals->end(); ++n)
+            qnormals->push_back( osg::Vec3b(toSByte(n->x()), toSByte(n->y()), toSByte(n->z())) );
+        qnormals->setNormalize( true );
+        bytesBefore += normals->getTotalDataSize();
+        bytesAfter  += qnormals->getTotalDataSize();
+        geom->setNormalArray( qnormals );
+        geom->setNormalBinding( geom->BIND_PER_VERTEX );
+    }
+
+    // colors
+    osg::Vec4Array* colors = dynamic_cast<osg::Vec4Array*>(geom->getColorArray());
+    if ( colors && geom->getColorBinding() == geom->BIND_PER_VERTEX )
+    {
+        osg::Vec4ubArray* qcolors = new osg::Vec4ubArray();
+        qcolors->reserve( colors->size() );
+        for(osg::Vec4Array::const_iterator c = colors->begin(); c != colors->end(); ++c)
+            qcolors->push_back( osg::Vec4ub(toUByte(c->r()), toUByte(c->g()), toUByte(c->b()), toUByte(c->a())) );
+        qcolors->setNormalize( true );
+        bytesBefore += colors->getTotalDataSize();
+        bytesAfter  += qcolors->getTotalDataSize();
+        geom->setColorArray( qcolors );
+        geom->setColorBinding( geom->BIND_PER_VERTEX );
+    }
+
+    // texture coordinates; the layer stays an integer in (r).
+    osg::Vec3Array* texCoords = dynamic_cast<osg::Vec3Array*>(geom->getTexCoordArray(0));
+    if ( texCoords )
+    {
+        const float invUVScale = 1.0f / getTexCoordScale();
+        osg::Vec3sArray* qtexCoords = new osg::Vec3sArray();
+        qtexCoords->reserve( texCoords->size() );
+        for(osg::Vec3Array::const_iterator t = texCoords->begin(); t != texCoords->end(); ++t)
+            qtexCoords->push_back( osg::Vec3s(toShort(t->x()*invUVScale), toShort(t->y()*invUVScale), toShort(t->z())) );
+        bytesBefore += texCoords->getTotalDataSize();
+        bytesAfter  += qtexCoords->getTotalDataSize();
+        geom->setTexCoordArray( 0, qtexCoords );
+    }
+
+    _bytesSaved += bytesBefore - bytesAfter;
+
+    return true;
+}
+
+void
+VertexQuantizer::applyTexCoordScale(osg::StateSet* stateSet) const
+{
+    stateSet->addUniform( new osg::Uniform("oeb_uv_scale", getTexCoordScale()) );
+}